@@ -13,41 +13,66 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/CallGraphSCCPass.h"
+#include "llvm/AsmParser/Parser.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LegacyPassNameParser.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/IR/PassInstrumentation.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PluginLoader.h"
 #include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
+#include <chrono>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <numeric>
 #include <pthread.h>
+#include <random>
 #include <sched.h>
 #include <set>
+#include <signal.h>
 #include <sstream>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
@@ -63,6 +88,13 @@ cl::opt<int> Cores("cores", cl::desc("How many cores to use (default=1)"),
 cl::opt<int> W("width", cl::desc("Base integer width (default=2)"), cl::init(2),
                llvm::cl::cat(optfuzz_args));
 
+cl::list<int> Widths(
+    "widths",
+    cl::desc("Instead of --width, enumerate functions once and emit each at "
+             "every one of these widths where it is legal; needs --fewconsts "
+             "or --symbolic-consts"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
 cl::opt<int> N("num-insns", cl::desc("Number of instructions (default=2)"),
                cl::init(2), llvm::cl::cat(optfuzz_args));
 
@@ -78,9 +110,19 @@ cl::opt<bool>
 
 cl::opt<bool>
     ARM64("arm64",
-          cl::desc("Set target triple and datalayout for AArch64 (default=false)"),
+          cl::desc("Set target triple and datalayout for AArch64, like "
+                   "--targets=aarch64 but without its promotion "
+                   "(default=false)"),
           cl::init(false), llvm::cl::cat(optfuzz_args));
 
+cl::list<std::string> Targets(
+    "targets",
+    cl::desc("Emit every function once for each of these targets, with its "
+             "triple, datalayout and the --promote width its calling "
+             "convention needs, into a subdirectory per target when there "
+             "are several: any of x86_64, aarch64, riscv64, i686, riscv32"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
 cl::opt<bool> GenerateFreeze("generate-freeze",
                              cl::desc("Generate freeze (default=true)"),
                              cl::init(true), llvm::cl::cat(optfuzz_args));
@@ -103,9 +145,21 @@ cl::opt<bool> RetToMem("return-to-memory",
 
 cl::opt<bool>
     Branch("branches",
-           cl::desc("Generate branches (default=false) (broken don't use)"),
+           cl::desc("Generate control flow: every CFG shape with up to "
+                    "--num-blocks blocks is tried (default=false)"),
            cl::init(false), llvm::cl::cat(optfuzz_args));
 
+cl::opt<int> NumBlocks("num-blocks",
+                       cl::desc("Largest number of basic blocks for "
+                                "--branches, at most 5 (default=3)"),
+                       cl::init(3), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> Loops("loops",
+                    cl::desc("Let --branches generate back edges; shapes "
+                             "with loops are tried after all acyclic ones "
+                             "(default=true)"),
+                    cl::init(true), llvm::cl::cat(optfuzz_args));
+
 cl::opt<bool>
     UseIntrinsics("use-intrinsics",
                   cl::desc("Generate intrinsics like ctpop (default=true)"),
@@ -133,11 +187,37 @@ cl::opt<bool> NoUB("noub",
                    cl::desc("Do not put UB flags on binops (default=false)"),
                    cl::init(false), llvm::cl::cat(optfuzz_args));
 
+cl::list<std::string> Allow(
+    "allow",
+    cl::desc("Only generate these opcodes, intrinsics, flags, or icmp "
+             "predicates; a kind that isn't mentioned isn't restricted"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
+cl::list<std::string> Deny(
+    "deny",
+    cl::desc("Never generate these opcodes, intrinsics, flags, or icmp "
+             "predicates"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
+cl::list<std::string> Require(
+    "require",
+    cl::desc("Only emit functions that contain these opcodes, intrinsics, "
+             "flags, or icmp predicates; repeat one to require it several "
+             "times"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
 cl::opt<bool> RemoveUnusedArgs(
     "remove-unused-args",
-    cl::desc("Remove unused function arguments (default=true)"), cl::init(true),
+    cl::desc("Only give functions the arguments they use (default=true)"),
+    cl::init(true),
     llvm::cl::cat(optfuzz_args));
 
+cl::opt<bool> ExactInsns(
+    "exact-insns",
+    cl::desc("Only emit functions that use all of --num-insns, so that runs "
+             "with increasing sizes don't repeat each other (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
 cl::opt<bool>
     Geni1("geni1",
           cl::desc("Functions return i1 instead of iN (default=false)"),
@@ -149,10 +229,193 @@ cl::opt<bool>
                        "few selected constants (default=false)"),
               cl::init(false), llvm::cl::cat(optfuzz_args));
 
-cl::opt<bool> Verify("verify", cl::desc("Run the LLVM verifier (default=true)"),
-                     cl::init(true), llvm::cl::cat(optfuzz_args));
+cl::opt<bool> SymbolicConsts(
+    "symbolic-consts",
+    cl::desc("Full-width constants become extra function parameters %c0, "
+             "%c1, ... instead of being enumerated (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::list<std::string> ConstValues(
+    "const-values",
+    cl::desc("With --symbolic-consts, instantiate each function with every "
+             "combination of these values for its constants: any of edge, "
+             "pow2, mask, or a file holding one value per line"),
+    cl::CommaSeparated, llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> ConstTuples(
+    "const-tuples",
+    cl::desc("With --symbolic-consts, instantiate each function with the "
+             "tuples in this file (one per line) that have as many values "
+             "as the function has constants (default=none)"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<int> MaxConstTuples(
+    "max-const-tuples",
+    cl::desc("Instantiate each function with at most this many combinations "
+             "of --const-values, spread evenly over all of them "
+             "(default=1000)"),
+    cl::init(1000), llvm::cl::cat(optfuzz_args));
+
+cl::opt<unsigned> Seed("seed",
+                       cl::desc("Seed for the pseudorandom choices made by "
+                                "--fewconsts and operand shuffling "
+                                "(default=0)"),
+                       cl::init(0), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string>
+    Replay("replay",
+           cl::desc("Regenerate only the function with this choice string "
+                    "(found in the comments of every emitted function) and "
+                    "print it; other options must match the original run"),
+           cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> Reduce(
+    "reduce",
+    cl::desc("Search for a smaller function than the one with this choice "
+             "string that --oracle still considers interesting"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string>
+    Oracle("oracle",
+           cl::desc("With --reduce, a shell command that is passed the "
+                    "file holding a candidate (and ones holding its "
+                    "optimized versions, with --passes and "
+                    "--compare-passes) and exits with 0 "
+                    "if it is still interesting"),
+           cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> Verify("verify",
+                     cl::desc("Run the LLVM verifier on every function "
+                              "(default=false)"),
+                     cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::opt<int> VerifyEvery("verify-every",
+                         cl::desc("Run the LLVM verifier on one function in "
+                                  "N, 0 for none (default=1000)"),
+                         cl::init(1000), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> UseFastPrinter(
+    "fast-printer",
+    cl::desc("Print functions with opt-fuzz's own printer, which only "
+             "knows the IR that opt-fuzz generates and falls back to LLVM's "
+             "for anything else (default=true)"),
+    cl::init(true), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> CheckPrinter(
+    "check-printer",
+    cl::desc("Also print every function with LLVM's printer and abort if "
+             "the two differ (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string>
+    Passes("passes",
+           cl::desc("Optimize each function in-process using this new pass "
+                    "manager pipeline, e.g. \"instcombine\" (default=none)"),
+           cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> ComparePasses(
+    "compare-passes",
+    cl::desc("Also optimize each function with this second pipeline and "
+             "write out the ones where the two results differ in size, "
+             "flags, attributes, or behavior (default=none)"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<unsigned> CompareInputs(
+    "compare-inputs",
+    cl::desc("With --compare-passes, run the three versions of a function "
+             "on every input if there are at most this many, otherwise on "
+             "this many pseudorandom ones; 0 to not run them (default=4096)"),
+    cl::init(4096), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> CompareCSV(
+    "compare-csv",
+    cl::desc("With --compare-passes, append a line per differing function "
+             "to this file (default=compare.csv)"),
+    cl::init("compare.csv"), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> TimeCompile(
+    "time-compile",
+    cl::desc("Time the --passes pipeline, pass by pass, on every function "
+             "and write out only the ones that are unusually slow to "
+             "compile (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> TimeCodegen(
+    "time-codegen",
+    cl::desc("With --time-compile, also time code generation for each "
+             "function's target (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::opt<double> SlowPercentile(
+    "slow-percentile",
+    cl::desc("With --time-compile, a function is slow if a pass or code "
+             "generation takes longer on it than on this percentage of the "
+             "functions seen so far, 0 for never (default=99.9)"),
+    cl::init(99.9), llvm::cl::cat(optfuzz_args));
+
+cl::opt<unsigned> SlowMicros(
+    "slow-micros",
+    cl::desc("With --time-compile, a function is also slow if a pass or code "
+             "generation takes longer than this many microseconds on it, 0 "
+             "for no limit (default=0)"),
+    cl::init(0), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string>
+    VerifierCmd("verifier",
+                cl::desc("Shell command for a persistent verifier worker that "
+                         "speaks the opt-fuzz worker protocol on stdin/stdout; "
+                         "only failing functions are written (default=none)"),
+                cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<int> VerifierJobs("verifier-jobs",
+                          cl::desc("Number of --verifier workers to start "
+                                   "(default=same as --cores)"),
+                          cl::init(-1), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> VerifierSocket(
+    "verifier-socket",
+    cl::desc("Unix socket where a verifier worker pool speaking the opt-fuzz "
+             "worker protocol is listening (default=none)"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> VerdictCache(
+    "verdict-cache",
+    cl::desc("Directory holding verdicts from earlier runs; functions whose "
+             "original and optimized IR, pipeline, and checker version are "
+             "unchanged aren't sent to the verifier again (default=none)"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<std::string> CheckerVersion(
+    "checker-version",
+    cl::desc("Version of the verifier, part of the --verdict-cache key; "
+             "bump it to invalidate cached verdicts (default=\"\")"),
+    cl::init(""), llvm::cl::cat(optfuzz_args));
+
+cl::opt<bool> CoverageGuided(
+    "coverage-guided",
+    cl::desc("Record which transformations fire on each function (needs "
+             "--passes) and let subtrees that keep turning up new ones run "
+             "ahead of the rest (default=false)"),
+    cl::init(false), llvm::cl::cat(optfuzz_args));
+
+cl::opt<unsigned>
+    TimeLimit("time-limit",
+              cl::desc("Stop generating after this many seconds, 0 for no "
+                       "limit (default=0)"),
+              cl::init(0), llvm::cl::cat(optfuzz_args));
 
 #define MAX_DEPTH 100
+#define MAX_WORKERS 256
+// waiting processes are woken by priority level first, then by depth
+#define PRIO_LEVELS 4
+// coverage features and choice prefixes are hashed into tables this big
+#define COV_BITS 16
+#define COV_SIZE (1 << COV_BITS)
+// --time-compile keeps a histogram of nanoseconds per pass, with
+// HIST_SUB buckets per power of two
+#define MAX_TIMED 256
+#define HIST_SUB 4
+#define HIST_BUCKETS (64 * HIST_SUB)
 
 #undef assert
 #define STRINGIFY(x) #x
@@ -168,34 +431,109 @@ struct shared {
   std::atomic_long NextId;
   pthread_mutex_t Lock;
   pthread_mutexattr_t LockAttr;
-  pthread_cond_t Cond[MAX_DEPTH];
-  int Waiting[MAX_DEPTH];
+  pthread_cond_t Cond[PRIO_LEVELS][MAX_DEPTH];
+  // processes blocked on each condition, and signals not yet taken
+  int Waiting[PRIO_LEVELS][MAX_DEPTH];
+  int Signaled[PRIO_LEVELS][MAX_DEPTH];
   pthread_condattr_t CondAttr;
   int Running;
   bool Stop;
+  bool TimedOut;
+  pthread_cond_t WorkerCond;
+  bool WorkerBusy[MAX_WORKERS];
+  std::atomic_long NumCorrect, NumFailed, NumErrors, NumCached;
+  // for --coverage-guided
+  std::atomic_bool Covered[COV_SIZE];
+  std::atomic_uint Leaves[COV_SIZE], Novel[COV_SIZE];
+  std::atomic_long NumFeatures;
+  // for --compare-passes
+  std::atomic_long NumCompared, NumDiffInsns, NumDiffFlags, NumDiffBehavior,
+      NumWrong;
+  // for --time-compile; a histogram is claimed under Lock by naming it
+  struct {
+    char Name[64];
+    std::atomic_long Count, NumSlow, Max;
+    std::atomic_long Buckets[HIST_BUCKETS];
+  } Hist[MAX_TIMED];
+  std::atomic_long NumTimed, NumSlow;
 } * Shmem;
 std::string Choices;
 long Id;
+std::vector<int> ReplayChoices;
+unsigned ReplayPos = 0;
+bool Replaying = false;
+// when reducing, edited choice strings are made to fit
+bool LenientReplay = false;
+std::string CommandLine;
+// with several --targets each one is written to its own directory
+std::string OutDir;
 
 int Depth = 1;
 bool Init = false;
+pid_t RootPid;
+time_t Deadline = 0;
+
+void finish();
+
+void stopAll() {
+  // not checking return values here...
+  pthread_mutex_lock(&Shmem->Lock);
+  Shmem->Stop = true;
+  for (int p = 0; p < PRIO_LEVELS; ++p)
+    for (int i = 0; i < MAX_DEPTH; ++i)
+      pthread_cond_broadcast(&Shmem->Cond[p][i]);
+  pthread_cond_broadcast(&Shmem->WorkerCond);
+  pthread_mutex_unlock(&Shmem->Lock);
+}
 
 void die(const char *str) {
   errs() << "ABORTING: " << str << "\n";
   if (Init) {
-    // not checking return value here...
-    pthread_mutex_lock(&Shmem->Lock);
-    Shmem->Stop = true;
-    for (int i = 0; i < MAX_DEPTH; ++i)
-      pthread_cond_broadcast(&Shmem->Cond[i]);
-    pthread_mutex_unlock(&Shmem->Lock);
-  } else {
+    stopAll();
+  } else if (Shmem) {
+    // options are checked before there's any shared memory to flag
     Shmem->Stop = true;
   }
   exit(-1);
 }
 
+/*
+ * called, with the lock held, by a process that notices Stop; the
+ * root process still has to wait for everyone else and report
+ */
+void leave() {
+  pthread_mutex_unlock(&Shmem->Lock);
+  if (Init && ::getpid() == RootPid) {
+    finish();
+    exit(Shmem->TimedOut ? 0 : -1);
+  }
+  exit(-1);
+}
+
+void exitDescendant();
+
+/*
+ * abandon the function being generated; like leave(), the root
+ * process first waits for everyone else and reports
+ */
+void prune() {
+  // a --reduce candidate may be pruned, but a --replay has to print
+  if (!Replay.empty())
+    die("--replay choice string reaches a pruned function");
+  if (Init && ::getpid() == RootPid && !Replaying)
+    finish();
+  if (RootPid && ::getpid() != RootPid)
+    exitDescendant();
+  exit(0);
+}
+
+// whether this process holds one of the Cores slots
+bool HoldsSlot = true;
+
 void decrease_runners(void) {
+  if (!HoldsSlot)
+    return;
+  HoldsSlot = false;
   if (pthread_mutex_lock(&Shmem->Lock) != 0)
     die("lock failed");
 
@@ -203,20 +541,86 @@ void decrease_runners(void) {
 
   Shmem->Running--;
   // FIXME could cache the max depth, perhaps don't care
-  for (int i = MAX_DEPTH - 1; i >= 0; --i) {
-    if (Shmem->Waiting[i] != 0) {
-      Shmem->Waiting[i]--;
-      if (pthread_cond_signal(&Shmem->Cond[i]) != 0)
-        die("pthread_cond_signal failed");
-      break;
+  for (int p = PRIO_LEVELS - 1; p >= 0; --p) {
+    for (int i = MAX_DEPTH - 1; i >= 0; --i) {
+      if (Shmem->Waiting[p][i] > Shmem->Signaled[p][i]) {
+        Shmem->Signaled[p][i]++;
+        if (pthread_cond_signal(&Shmem->Cond[p][i]) != 0)
+          die("pthread_cond_signal failed");
+        goto done;
+      }
     }
   }
+done:
 
   if (pthread_mutex_unlock(&Shmem->Lock) != 0)
     die("unlock failed");
 }
 
+/*
+ * how a process forked off the root finishes: _exit() skips the static
+ * destructors, thousands of them once the pass pipeline is linked in,
+ * which wrote to pages the process shared with its parent. it also
+ * skips atexit handlers, and decrease_runners() is the only one we
+ * register. files are written whole through writeFile(), so the
+ * streams are all that can still hold output
+ */
+void exitDescendant() {
+  decrease_runners();
+  outs().flush();
+  errs().flush();
+  ::_exit(0);
+}
+
+uint32_t hashStep(uint32_t H, char c) {
+  H ^= (unsigned char)c;
+  return H * 16777619u;
+}
+
+const uint32_t HashBasis = 2166136261u;
+
+/*
+ * running hashes of Choices, so that nothing on the path of every
+ * Choose() has to rehash all of it: one for the coverage tables, and
+ * one that also depends on --seed for rand()
+ */
+uint32_t ChoicesHash = HashBasis, SeededHash;
+
+/*
+ * the priority of a process waiting to explore more of the subtree
+ * below its choice string: how often leaves already reached from
+ * there turned up new coverage
+ */
+int priority() {
+  if (!CoverageGuided)
+    return 0;
+  unsigned Leaves = Shmem->Leaves[ChoicesHash % COV_SIZE];
+  unsigned Novel = Shmem->Novel[ChoicesHash % COV_SIZE];
+  if (Novel == 0)
+    return 0;
+  if (Novel * 8 < Leaves)
+    return 1;
+  if (Novel * 2 < Leaves)
+    return 2;
+  return 3;
+}
+
+/*
+ * whether a process at this priority and depth should let a waiter
+ * go first: the one with the highest priority, then the deepest one
+ */
+bool preempted(int Prio, int Depth) {
+  for (int p = PRIO_LEVELS - 1; p >= Prio; --p)
+    for (int i = MAX_DEPTH - 1; i > (p == Prio ? Depth : -1); --i)
+      if (Shmem->Waiting[p][i] > 0)
+        return true;
+  return false;
+}
+
 void increase_runners(int Depth) {
+  // the child that was just forked has this process's slot
+  HoldsSlot = false;
+  int Prio = priority();
   if (pthread_mutex_lock(&Shmem->Lock) != 0)
     die("lock failed");
 
@@ -224,31 +628,89 @@ void increase_runners(int Depth) {
     die("oops, you'll need to rebuild opt-fuzz with a larger MAX_DEPTH");
   assert(Shmem->Running <= Cores);
 
-  while (Shmem->Running >= Cores) {
-    Shmem->Waiting[Depth]++;
-    if (Shmem->Stop) {
-      pthread_mutex_unlock(&Shmem->Lock);
-      exit(-1);
-    }
-    if (pthread_cond_wait(&Shmem->Cond[Depth], &Shmem->Lock))
+  while (Shmem->Running >= Cores || preempted(Prio, Depth)) {
+    if (Shmem->Stop)
+      leave();
+    /*
+     * waiters do their own bookkeeping so that spurious wakeups can't
+     * throw it off, and never sleep for long since some versions of
+     * glibc can lose a pthread_cond_signal(); a waiter that times out
+     * still doesn't jump ahead of the ones that should go first
+     */
+    struct timespec Until;
+    clock_gettime(CLOCK_REALTIME, &Until);
+    Until.tv_sec += 1;
+    Shmem->Waiting[Prio][Depth]++;
+    int Res = pthread_cond_timedwait(&Shmem->Cond[Prio][Depth], &Shmem->Lock,
+                                     &Until);
+    if (Res != 0 && Res != ETIMEDOUT)
       die("pthread_cond_wait failed");
-    if (Shmem->Stop) {
-      pthread_mutex_unlock(&Shmem->Lock);
-      exit(-1);
-    }
+    Shmem->Waiting[Prio][Depth]--;
+    if (Shmem->Signaled[Prio][Depth] > 0)
+      Shmem->Signaled[Prio][Depth]--;
+    if (Shmem->Stop)
+      leave();
   }
   Shmem->Running++;
+  HoldsSlot = true;
 
   if (pthread_mutex_unlock(&Shmem->Lock) != 0)
     die("unlock failed");
 }
 
+/*
+ * rand() is reseeded from the choices made so far, so that a function
+ * is completely determined by its choice string (and --seed)
+ */
+void reseed() { ::srand(SeededHash); }
+
+// Choices changes only through these, which keep its hashes up to date
+void setChoices(const std::string &S) {
+  Choices = S;
+  ChoicesHash = HashBasis;
+  SeededHash = HashBasis ^ Seed;
+  for (char c : S) {
+    ChoicesHash = hashStep(ChoicesHash, c);
+    SeededHash = hashStep(SeededHash, c);
+  }
+  reseed();
+}
+
+void addChoice(int i) {
+  std::string S = std::to_string(i) + " ";
+  Choices += S;
+  for (char c : S) {
+    ChoicesHash = hashStep(ChoicesHash, c);
+    SeededHash = hashStep(SeededHash, c);
+  }
+  reseed();
+}
+
 int Choose(int n) {
   assert(n > 0);
+  if (Replaying) {
+    int i;
+    if (LenientReplay) {
+      i = ReplayPos < ReplayChoices.size() ? ReplayChoices[ReplayPos++] : 0;
+      i = std::min(std::max(i, 0), n - 1);
+    } else {
+      if (ReplayPos >= ReplayChoices.size())
+        die("--replay choice string is too short");
+      i = ReplayChoices[ReplayPos++];
+      if (i < 0 || i >= n)
+        die("--replay choice string doesn't match this configuration");
+    }
+    addChoice(i);
+    return i;
+  }
+  if (Deadline && !Shmem->Stop && ::time(nullptr) >= Deadline) {
+    Shmem->TimedOut = true;
+    stopAll();
+  }
   for (int i = 0; i < (n - 1); ++i) {
     if (Shmem->Stop) {
-      pthread_mutex_unlock(&Shmem->Lock);
-      exit(-1);
+      pthread_mutex_lock(&Shmem->Lock);
+      leave();
     }
     int ret = ::fork();
     if (ret == -1)
@@ -256,16 +718,15 @@ int Choose(int n) {
     if (ret == 0) {
       // child
       Id = Shmem->NextId.fetch_add(1);
-      Choices += std::to_string(i) + " ";
+      addChoice(i);
       ++Depth;
-      ::srand(::getpid());
       return i;
     }
     // parent
     increase_runners(Depth);
     waitpid(-1, 0, WNOHANG);
   }
-  Choices += std::to_string(n - 1) + " ";
+  addChoice(n - 1);
   return n - 1;
 }
 
@@ -274,16 +735,59 @@ LLVMContext C;
 std::vector<Value *> Vals;
 Function *F;
 Module *M;
-std::vector<Value *> Args;
-std::set<Value *> UsedArgs;
+/*
+ * inputs are placeholder Arguments, created the first time they are
+ * offered; finishSignature() turns the ones that got used into
+ * parameters, in the order of ArgWidths
+ */
+std::vector<int> ArgWidths;
+std::vector<Argument *> Args;
 std::vector<BasicBlock *> BBs;
-std::vector<BranchInst *> Branches;
+// with --branches, only values from blocks dominating UseBlock are in scope
+DominatorTree *DT = nullptr;
+BasicBlock *UseBlock;
+
+std::vector<Argument *> ConstArgs;
 
 Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK = true);
 
+bool isConstLike(Value *V) {
+  if (isa<Constant>(V))
+    return true;
+  auto *A = dyn_cast<Argument>(V);
+  return A && std::find(ConstArgs.begin(), ConstArgs.end(), A) !=
+                  ConstArgs.end();
+}
+
+/*
+ * for --exact-insns we need to know whether some operand that hasn't
+ * been generated yet could still use up the remaining budget; only
+ * full-width and i1 values can be instructions, other widths are
+ * always leaves
+ */
+int PendingSlots = 0;
+
+bool canUseBudget(int Width) { return Width == W || Width == 1; }
+
+struct ReservedSlot {
+  bool Held;
+  ReservedSlot(int Width) : Held(canUseBudget(Width)) {
+    if (Held)
+      ++PendingSlots;
+  }
+  void release() {
+    if (Held)
+      --PendingSlots;
+    Held = false;
+  }
+  ~ReservedSlot() { release(); }
+};
+
 void gen2(Value *&L, Value *&R, int &Budget, int Width) {
+  ReservedSlot RS(Width);
   L = genVal(Budget, Width, true);
-  R = genVal(Budget, Width, !isa<Constant>(L) && !isa<UndefValue>(L));
+  RS.release();
+  R = genVal(Budget, Width, !isConstLike(L));
   if ((rand() & 1) == 0) {
     Value *T = L;
     L = R;
@@ -292,11 +796,12 @@ void gen2(Value *&L, Value *&R, int &Budget, int Width) {
 }
 
 std::vector<Value *> gen3(int &Budget, int Width) {
+  ReservedSlot RB(Width), RC(Width);
   auto A = genVal(Budget, Width, true);
+  RB.release();
   auto B = genVal(Budget, Width, true);
-  auto C = genVal(Budget, Width,
-                  (!isa<Constant>(A) && !isa<UndefValue>(A)) ||
-                      (!isa<Constant>(B) && !isa<UndefValue>(B)));
+  RC.release();
+  auto C = genVal(Budget, Width, !isConstLike(A) || !isConstLike(B));
   switch (rand() % 6) {
   case 0:
     return std::vector{A, B, C};
@@ -311,7 +816,7 @@ std::vector<Value *> gen3(int &Budget, int Width) {
   case 5:
     return std::vector{C, B, A};
   }
-  assert(false);
+  llvm_unreachable("bad permutation");
 }
 
 // true pseudorandom, not BET
@@ -329,78 +834,316 @@ bool okForBitIntrinsic(int W) {
   return W == 8 || W == 16 || W == 32 || W == 64 || W == 128 || W == 256;
 }
 
-Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
-  if (Branch && Budget > 0 && Choose(2)) {
-    --Budget;
-    Value *V = Builder->CreatePHI(Type::getIntNTy(C, Width), N);
-    assert(V);
-    Vals.push_back(V);
-    return V;
+bool okForByteIntrinsic(int W) { return W == 16 || W == 32 || W == 64; }
+
+/*
+ * with --widths the gates that depend on the width are left open, so
+ * that the choices don't depend on it; instead a function remembers
+ * what it needs from a width, and is only emitted at widths that have
+ * it
+ */
+enum { NEEDS_BIT_WIDTH = 1, NEEDS_BYTE_WIDTH = 2, NEEDS_HALF_WIDTH = 4 };
+unsigned WidthNeeds = 0;
+
+bool skeletons() { return !Widths.empty(); }
+
+bool widthOK(int Width) {
+  if ((WidthNeeds & NEEDS_BIT_WIDTH) && !okForBitIntrinsic(Width))
+    return false;
+  if ((WidthNeeds & NEEDS_BYTE_WIDTH) && !okForByteIntrinsic(Width))
+    return false;
+  // otherwise W/2 values would mix with the i1 ones
+  if ((WidthNeeds & NEEDS_HALF_WIDTH) && Width / 2 == 1)
+    return false;
+  return true;
+}
+
+/*
+ * --allow, --deny and --require: the generator is only offered what's
+ * allowed, and a function is pruned as soon as the instructions left
+ * in its budget can't meet the requirements
+ */
+enum FeatureKind { FEATURE_OP, FEATURE_FLAG, FEATURE_PRED };
+StringMap<FeatureKind> Features;
+
+std::vector<Instruction::BinaryOps> BinOps;
+std::vector<Instruction::CastOps> ExtOps;
+std::vector<CmpInst::Predicate> Predicates;
+std::vector<Intrinsic::ID> BitIntrinsics, FunnelIntrinsics, OverflowIntrinsics,
+    SatIntrinsics;
+bool GenSelect, GenTrunc, GenFreeze, GenPhi, GenNSW, GenNUW, GenExact;
+
+/*
+ * requirements that aren't met yet, and instructions being generated
+ * whose opcode or predicate is only chosen after their operands
+ */
+StringMap<int> Unmet;
+int UnmetOps = 0, UnmetPreds = 0, UndecidedOps = 0, UndecidedPreds = 0;
+
+std::string opcodeFeature(unsigned Opcode) {
+  return Instruction::getOpcodeName(Opcode);
+}
+
+std::string predicateFeature(CmpInst::Predicate P) {
+  return CmpInst::getPredicateName(P).str();
+}
+
+std::string intrinsicFeature(Intrinsic::ID ID) {
+  return Intrinsic::getBaseName(ID).drop_front(strlen("llvm.")).str();
+}
+
+bool allowed(const std::string &Name) {
+  if (is_contained(Deny, Name))
+    return false;
+  bool Restricted = false;
+  for (auto &A : Allow) {
+    if (A == Name)
+      return true;
+    if (Features.lookup(A) == Features.lookup(Name))
+      Restricted = true;
   }
+  return !Restricted;
+}
 
-  if (Branch && Budget > 0 && Budget != N && Choose(2)) {
-    --Budget;
-    BranchInst *Br;
-    if (0 && Builder->GetInsertBlock()->size() > 0 && Choose(2)) {
-      Br = Builder->CreateBr(BBs.at(0));
-    } else {
-      Value *C = genVal(Budget, 1, false, ArgOK);
-      Br = Builder->CreateCondBr(C, BBs[0], BBs[0]);
-    }
-    Branches.push_back(Br);
-    BasicBlock *BB = BasicBlock::Create(C, "", F);
-    BBs.push_back(BB);
-    Builder->SetInsertPoint(BB);
-    auto V = genVal(Budget, Width, ConstOK, ArgOK);
-    assert(V);
-    return V;
+template <typename T, typename NameFn>
+void addFeatures(ArrayRef<T> All, NameFn Name, FeatureKind K) {
+  for (T X : All)
+    Features[Name(X)] = K;
+}
+
+template <typename T, typename NameFn>
+std::vector<T> allowedOf(ArrayRef<T> All, NameFn Name) {
+  std::vector<T> Res;
+  for (T X : All)
+    if (allowed(Name(X)))
+      Res.push_back(X);
+  return Res;
+}
+
+// in the order the generator has always offered them
+const Instruction::BinaryOps AllBinOps[] = {
+    Instruction::Add,  Instruction::Sub,  Instruction::Mul,
+    Instruction::SDiv, Instruction::UDiv, Instruction::SRem,
+    Instruction::URem, Instruction::And,  Instruction::Or,
+    Instruction::Xor,  Instruction::Shl,  Instruction::AShr,
+    Instruction::LShr};
+const Instruction::CastOps AllExtOps[] = {Instruction::SExt,
+                                          Instruction::ZExt};
+const CmpInst::Predicate AllPredicates[] = {
+    CmpInst::ICMP_EQ,  CmpInst::ICMP_NE,  CmpInst::ICMP_UGT, CmpInst::ICMP_UGE,
+    CmpInst::ICMP_ULT, CmpInst::ICMP_ULE, CmpInst::ICMP_SGT, CmpInst::ICMP_SGE,
+    CmpInst::ICMP_SLT, CmpInst::ICMP_SLE};
+const Intrinsic::ID AllBitIntrinsics[] = {
+    Intrinsic::ctpop, Intrinsic::bitreverse, Intrinsic::bswap,
+    Intrinsic::ctlz,  Intrinsic::cttz,       Intrinsic::abs};
+const Intrinsic::ID AllFunnelIntrinsics[] = {Intrinsic::fshr, Intrinsic::fshl};
+const Intrinsic::ID AllOverflowIntrinsics[] = {
+    Intrinsic::uadd_with_overflow, Intrinsic::sadd_with_overflow,
+    Intrinsic::usub_with_overflow, Intrinsic::ssub_with_overflow,
+    Intrinsic::umul_with_overflow, Intrinsic::smul_with_overflow};
+const Intrinsic::ID AllSatIntrinsics[] = {
+    Intrinsic::uadd_sat, Intrinsic::usub_sat, Intrinsic::sadd_sat,
+    Intrinsic::ssub_sat, Intrinsic::smax,     Intrinsic::smin,
+    Intrinsic::umax,     Intrinsic::umin,     Intrinsic::sshl_sat,
+    Intrinsic::ushl_sat};
+
+bool shapesHaveJoin();
+
+/*
+ * why a requirement can never be met by this configuration of the
+ * generator, or "" if it can
+ */
+std::string unmeetable(const std::string &Name) {
+  auto Named = [&](ArrayRef<Intrinsic::ID> IDs) {
+    for (Intrinsic::ID ID : IDs)
+      if (intrinsicFeature(ID) == Name)
+        return true;
+    return false;
+  };
+  bool Bit = Named(AllBitIntrinsics);
+  if ((Bit || Named(AllFunnelIntrinsics) || Named(AllOverflowIntrinsics) ||
+       Named(AllSatIntrinsics)) &&
+      !UseIntrinsics)
+    return "--use-intrinsics is off";
+  if (Bit && !skeletons() &&
+      (!okForBitIntrinsic(W) ||
+       ((Name == "bswap" || Name == "bitreverse") && !okForByteIntrinsic(W))))
+    return "it isn't generated at --width=" + std::to_string(W);
+  if (Name == "freeze" && !GenerateFreeze)
+    return "--generate-freeze is off";
+  if (Name == "phi" && !Branch)
+    return "--branches is off";
+  if (Name == "phi" && !shapesHaveJoin())
+    return "no CFG shape with --num-blocks=" + std::to_string(NumBlocks) +
+           " has a block with several predecessors";
+  if (Features.lookup(Name) == FEATURE_FLAG) {
+    if (NoUB)
+      return "--noub is on";
+    bool Exact = Name == "exact";
+    auto Ops = makeArrayRef(BinOps);
+    for (auto Op : OneBinop ? Ops.take_front() : Ops)
+      if (Exact ? (Op == Instruction::UDiv || Op == Instruction::SDiv ||
+                   Op == Instruction::LShr || Op == Instruction::AShr)
+                : (Op == Instruction::Add || Op == Instruction::Sub ||
+                   Op == Instruction::Mul || Op == Instruction::Shl))
+        return "";
+    return "no opcode that takes it is generated";
   }
+  if (OneBinop && !BinOps.empty() && Name != opcodeFeature(BinOps[0]))
+    for (auto Op : AllBinOps)
+      if (opcodeFeature(Op) == Name)
+        return "--onebinop only generates " + opcodeFeature(BinOps[0]);
+  if (Features.lookup(Name) == FEATURE_PRED) {
+    if (Predicates.empty())
+      return "icmp isn't allowed";
+    if (OneICmp && Name != predicateFeature(Predicates[0]))
+      return "--oneicmp only generates " + predicateFeature(Predicates[0]);
+  }
+  return "";
+}
 
-  if (UseIntrinsics && Budget > 0 && Width == W && okForBitIntrinsic(Width) &&
-      Choose(2)) {
+void setupConstraints() {
+  addFeatures<Instruction::BinaryOps>(AllBinOps, opcodeFeature, FEATURE_OP);
+  addFeatures<Instruction::CastOps>(AllExtOps, opcodeFeature, FEATURE_OP);
+  addFeatures<CmpInst::Predicate>(AllPredicates, predicateFeature,
+                                  FEATURE_PRED);
+  for (auto &All : {makeArrayRef(AllBitIntrinsics),
+                    makeArrayRef(AllFunnelIntrinsics),
+                    makeArrayRef(AllOverflowIntrinsics),
+                    makeArrayRef(AllSatIntrinsics)})
+    addFeatures<Intrinsic::ID>(All, intrinsicFeature, FEATURE_OP);
+  for (auto *Name : {"select", "icmp", "trunc", "freeze", "phi"})
+    Features[Name] = FEATURE_OP;
+  for (auto *Name : {"nsw", "nuw", "exact"})
+    Features[Name] = FEATURE_FLAG;
+  for (auto *List : {&Allow, &Deny, &Require})
+    for (auto &Name : *List)
+      if (!Features.count(Name))
+        die(("unknown opcode, intrinsic, flag, or predicate '" + Name + "'")
+                .c_str());
+
+  BinOps = allowedOf<Instruction::BinaryOps>(AllBinOps, opcodeFeature);
+  ExtOps = allowedOf<Instruction::CastOps>(AllExtOps, opcodeFeature);
+  if (allowed("icmp"))
+    Predicates = allowedOf<CmpInst::Predicate>(AllPredicates, predicateFeature);
+  BitIntrinsics = allowedOf<Intrinsic::ID>(AllBitIntrinsics, intrinsicFeature);
+  FunnelIntrinsics =
+      allowedOf<Intrinsic::ID>(AllFunnelIntrinsics, intrinsicFeature);
+  OverflowIntrinsics =
+      allowedOf<Intrinsic::ID>(AllOverflowIntrinsics, intrinsicFeature);
+  SatIntrinsics = allowedOf<Intrinsic::ID>(AllSatIntrinsics, intrinsicFeature);
+  GenSelect = allowed("select");
+  GenTrunc = allowed("trunc");
+  GenFreeze = allowed("freeze");
+  GenPhi = allowed("phi");
+  GenNSW = allowed("nsw");
+  GenNUW = allowed("nuw");
+  GenExact = allowed("exact");
+
+  for (auto &Name : Require) {
+    if (!allowed(Name))
+      die(("--require " + Name + " but it isn't allowed").c_str());
+    std::string Why = unmeetable(Name);
+    if (!Why.empty())
+      die(("--require " + Name + " but " + Why).c_str());
+    ++Unmet[Name];
+    FeatureKind K = Features.lookup(Name);
+    if (K == FEATURE_OP)
+      ++UnmetOps;
+    else if (K == FEATURE_PRED)
+      ++UnmetPreds;
+  }
+}
+
+// whether an instruction whose opcode or predicate is still to be
+// chosen from Options could meet a requirement
+template <typename T, typename NameFn>
+bool mayMeet(ArrayRef<T> Options, NameFn Name) {
+  if (Unmet.empty())
+    return false;
+  for (T X : Options)
+    if (Unmet.lookup(Name(X)) > 0)
+      return true;
+  return false;
+}
+
+template <typename T> T pick(const std::vector<T> &V) {
+  return V.size() > 1 ? V[Choose(V.size())] : V[0];
+}
+
+void note(const std::string &Name) {
+  if (Unmet.empty())
+    return;
+  auto It = Unmet.find(Name);
+  if (It == Unmet.end() || It->second == 0)
+    return;
+  --It->second;
+  FeatureKind K = Features.lookup(Name);
+  if (K == FEATURE_OP)
+    --UnmetOps;
+  else if (K == FEATURE_PRED)
+    --UnmetPreds;
+}
+
+// requirements that this function can no longer meet
+int Unmeetable = 0;
+
+/*
+ * a lower bound on the instructions still needed: each one can meet
+ * one opcode or intrinsic requirement and one predicate requirement.
+ * flags can be added to instructions that already exist, so they are
+ * only checked at the end
+ */
+int insnsNeeded() {
+  if (Unmeetable > 0)
+    return INT_MAX;
+  return std::max({0, UnmetOps - UndecidedOps, UnmetPreds - UndecidedPreds});
+}
+
+bool requirementsMet() {
+  for (auto &R : Unmet)
+    if (R.second > 0)
+      return false;
+  return true;
+}
+
+Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
+  if (insnsNeeded() > Budget)
+    prune();
+
+  if (UseIntrinsics && Budget > 0 && Width == W && !BitIntrinsics.empty() &&
+      (skeletons() || okForBitIntrinsic(Width)) && Choose(2)) {
     --Budget;
+    WidthNeeds |= NEEDS_BIT_WIDTH;
+    bool Undecided = mayMeet<Intrinsic::ID>(BitIntrinsics, intrinsicFeature);
+    UndecidedOps += Undecided;
     std::vector<Value *> A;
     std::vector<Type *> T;
     A.push_back(genVal(Budget, Width, false));
     T.push_back(A.at(0)->getType());
-    Intrinsic::ID ID;
-    switch (Choose(6)) {
-    case 0:
-      ID = Intrinsic::ctpop;
-      break;
-    case 1:
-      if (Width != 16 && Width != 32 && Width != 64)
-        exit(0);
-      ID = Intrinsic::bitreverse;
-      break;
-    case 2:
-      if (Width != 16 && Width != 32 && Width != 64)
-        exit(0);
-      ID = Intrinsic::bswap;
-      break;
-    case 3:
-      A.push_back(Builder->getInt1(Choose(2)));
-      ID = Intrinsic::ctlz;
-      break;
-    case 4:
-      A.push_back(Builder->getInt1(Choose(2)));
-      ID = Intrinsic::cttz;
-      break;
-    case 5:
-      A.push_back(Builder->getInt1(Choose(2)));
-      ID = Intrinsic::abs;
-      break;
+    Intrinsic::ID ID = pick(BitIntrinsics);
+    UndecidedOps -= Undecided;
+    note(intrinsicFeature(ID));
+    if (ID == Intrinsic::bitreverse || ID == Intrinsic::bswap) {
+      WidthNeeds |= NEEDS_BYTE_WIDTH;
+      if (!skeletons() && !okForByteIntrinsic(Width))
+        prune();
     }
+    if (ID == Intrinsic::ctlz || ID == Intrinsic::cttz || ID == Intrinsic::abs)
+      A.push_back(Builder->getInt1(Choose(2)));
     Value *V = Builder->CreateIntrinsic(ID, T, A);
     assert(V);
     Vals.push_back(V);
     return V;
   }
 
-  if (Budget > 0 && Width == W && Choose(2)) {
+  if (Budget > 0 && Width == W && GenSelect && Choose(2)) {
     --Budget;
+    note("select");
     Value *L, *R;
+    ReservedSlot RS(1);
     gen2(L, R, Budget, Width);
+    RS.release();
     Value *C = genVal(Budget, 1, false);
     Value *V = Builder->CreateSelect(C, L, R);
     assert(V);
@@ -408,52 +1151,28 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
     return V;
   }
 
-  if (Budget > 0 && Width == 1 && Choose(2)) {
+  if (Budget > 0 && Width == 1 && !Predicates.empty() && Choose(2)) {
     --Budget;
+    note("icmp");
+    auto Preds = makeArrayRef(Predicates);
+    bool Undecided = mayMeet<CmpInst::Predicate>(
+        OneICmp ? Preds.take_front() : Preds, predicateFeature);
+    UndecidedPreds += Undecided;
     Value *L, *R;
     gen2(L, R, Budget, W);
-    CmpInst::Predicate P;
-    switch (OneICmp ? 0 : Choose(10)) {
-    case 0:
-      P = CmpInst::ICMP_EQ;
-      break;
-    case 1:
-      P = CmpInst::ICMP_NE;
-      break;
-    case 2:
-      P = CmpInst::ICMP_UGT;
-      break;
-    case 3:
-      P = CmpInst::ICMP_UGE;
-      break;
-    case 4:
-      P = CmpInst::ICMP_ULT;
-      break;
-    case 5:
-      P = CmpInst::ICMP_ULE;
-      break;
-    case 6:
-      P = CmpInst::ICMP_SGT;
-      break;
-    case 7:
-      P = CmpInst::ICMP_SGE;
-      break;
-    case 8:
-      P = CmpInst::ICMP_SLT;
-      break;
-    case 9:
-      P = CmpInst::ICMP_SLE;
-      break;
-    }
+    CmpInst::Predicate P = OneICmp ? Predicates[0] : pick(Predicates);
+    UndecidedPreds -= Undecided;
+    note(predicateFeature(P));
     Value *V = Builder->CreateICmp(P, L, R);
     assert(V);
     Vals.push_back(V);
     return V;
   }
 
-  if (Budget > 0 && Width == W && Choose(2)) {
+  if (Budget > 0 && Width == W && GenTrunc && Choose(2)) {
     int OldW = Width * 2;
     --Budget;
+    note("trunc");
     Value *V = Builder->CreateTrunc(genVal(Budget, OldW, false),
                                     Type::getIntNTy(C, Width));
     assert(V);
@@ -461,9 +1180,10 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
     return V;
   }
 
-  if (Budget > 0 && Width == 1 && Choose(2)) {
+  if (Budget > 0 && Width == 1 && GenTrunc && Choose(2)) {
     int OldW = W;
     --Budget;
+    note("trunc");
     Value *V = Builder->CreateTrunc(genVal(Budget, OldW, false),
                                     Type::getIntNTy(C, 1));
     assert(V);
@@ -471,87 +1191,49 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
     return V;
   }
 
-  if (Budget > 0 && Width == W && Choose(2)) {
+  if (Budget > 0 && Width == W && !ExtOps.empty() && Choose(2)) {
     int OldW = Width / 2;
-    if (OldW > 1 && Choose(2))
+    if ((skeletons() || OldW > 1) && Choose(2))
       OldW = 1;
+    if (OldW != 1)
+      WidthNeeds |= NEEDS_HALF_WIDTH;
     --Budget;
-    Value *V;
-    if (Choose(2))
-      V = Builder->CreateZExt(genVal(Budget, OldW, false),
-                              Type::getIntNTy(C, Width));
-    else
-      V = Builder->CreateSExt(genVal(Budget, OldW, false),
-                              Type::getIntNTy(C, Width));
+    Instruction::CastOps Op = pick(ExtOps);
+    note(opcodeFeature(Op));
+    Value *V = Builder->CreateCast(Op, genVal(Budget, OldW, false),
+                                   Type::getIntNTy(C, Width));
     Vals.push_back(V);
     return V;
   }
 
-  if (Budget > 0 && Width == W && Choose(2)) {
+  if (Budget > 0 && Width == W && !BinOps.empty() && Choose(2)) {
     --Budget;
-    Instruction::BinaryOps Op;
-    switch (OneBinop ? 0 : Choose(13)) {
-    case 0:
-      Op = Instruction::Add;
-      break;
-    case 1:
-      Op = Instruction::Sub;
-      break;
-    case 2:
-      Op = Instruction::Mul;
-      break;
-    case 3:
-      Op = Instruction::SDiv;
-      break;
-    case 4:
-      Op = Instruction::UDiv;
-      break;
-    case 5:
-      Op = Instruction::SRem;
-      break;
-    case 6:
-      Op = Instruction::URem;
-      break;
-    case 7:
-      Op = Instruction::And;
-      break;
-    case 8:
-      Op = Instruction::Or;
-      break;
-    case 9:
-      Op = Instruction::Xor;
-      break;
-    case 10:
-      Op = Instruction::Shl;
-      break;
-    case 11:
-      Op = Instruction::AShr;
-      break;
-    case 12:
-      Op = Instruction::LShr;
-      break;
-    }
+    Instruction::BinaryOps Op = OneBinop ? BinOps[0] : pick(BinOps);
+    note(opcodeFeature(Op));
     Value *L, *R;
     gen2(L, R, Budget, Width);
     Value *V = Builder->CreateBinOp(Op, L, R);
     if (!NoUB) {
       if ((Op == Instruction::Add || Op == Instruction::Sub ||
            Op == Instruction::Mul || Op == Instruction::Shl) &&
-          Choose(2)) {
+          GenNSW && Choose(2)) {
         BinaryOperator *B = cast<BinaryOperator>(V);
         B->setHasNoSignedWrap(true);
+        note("nsw");
       }
       if ((Op == Instruction::Add || Op == Instruction::Sub ||
            Op == Instruction::Mul || Op == Instruction::Shl) &&
-          Choose(2)) {
+          GenNUW && Choose(2)) {
         BinaryOperator *B = cast<BinaryOperator>(V);
         B->setHasNoUnsignedWrap(true);
+        note("nuw");
       }
       if ((Op == Instruction::UDiv || Op == Instruction::SDiv ||
            Op == Instruction::LShr || Op == Instruction::AShr) &&
-          Choose(2)) {
+          GenExact && Choose(2)) {
         BinaryOperator *B = cast<BinaryOperator>(V);
         B->setIsExact(true);
+        note("exact");
       }
     }
     assert(V);
@@ -559,10 +1241,15 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
     return V;
   }
 
-  if (UseIntrinsics && Budget > 0 && Width == W && Choose(2)) {
+  if (UseIntrinsics && Budget > 0 && Width == W && !FunnelIntrinsics.empty() &&
+      Choose(2)) {
     --Budget;
+    bool Undecided = mayMeet<Intrinsic::ID>(FunnelIntrinsics, intrinsicFeature);
+    UndecidedOps += Undecided;
     std::vector<Value *> Args = gen3(Budget, Width);
-    Intrinsic::ID ID = Choose(2) ? Intrinsic::fshl : Intrinsic::fshr;
+    Intrinsic::ID ID = pick(FunnelIntrinsics);
+    UndecidedOps -= Undecided;
+    note(intrinsicFeature(ID));
     std::vector<Type *> T{Type::getIntNTy(C, Width)};
     Value *V = Builder->CreateIntrinsic(ID, T, Args);
     assert(V);
@@ -572,31 +1259,17 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
 
   // this one is a bit different than other instructions since we'll
   // synthesize it when either a full-width value or an i1 is required
-  if (UseIntrinsics && Budget > 0 && (Width == 1 || Width == W) && Choose(2)) {
+  if (UseIntrinsics && Budget > 0 && (Width == 1 || Width == W) &&
+      !OverflowIntrinsics.empty() && Choose(2)) {
     --Budget;
+    bool Undecided =
+        mayMeet<Intrinsic::ID>(OverflowIntrinsics, intrinsicFeature);
+    UndecidedOps += Undecided;
     Value *L, *R;
     gen2(L, R, Budget, W);
-    Intrinsic::ID ID;
-    switch (Choose(6)) {
-    case 0:
-      ID = Intrinsic::uadd_with_overflow;
-      break;
-    case 1:
-      ID = Intrinsic::sadd_with_overflow;
-      break;
-    case 2:
-      ID = Intrinsic::usub_with_overflow;
-      break;
-    case 3:
-      ID = Intrinsic::ssub_with_overflow;
-      break;
-    case 4:
-      ID = Intrinsic::umul_with_overflow;
-      break;
-    case 5:
-      ID = Intrinsic::smul_with_overflow;
-      break;
-    }
+    Intrinsic::ID ID = pick(OverflowIntrinsics);
+    UndecidedOps -= Undecided;
+    note(intrinsicFeature(ID));
     Value *V = Builder->CreateBinaryIntrinsic(ID, L, R);
     assert(V);
     Value *V1 = Builder->CreateExtractValue(V, 0);
@@ -611,43 +1284,11 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
       return V1;
   }
 
-  if (UseIntrinsics && Budget > 0 && Width == W && Choose(2)) {
+  if (UseIntrinsics && Budget > 0 && Width == W && !SatIntrinsics.empty() &&
+      Choose(2)) {
     --Budget;
-    Intrinsic::ID ID;
-    switch (Choose(10)) {
-    case 0:
-      ID = Intrinsic::uadd_sat;
-      break;
-    case 1:
-      ID = Intrinsic::usub_sat;
-      break;
-    case 2:
-      ID = Intrinsic::sadd_sat;
-      break;
-    case 3:
-      ID = Intrinsic::ssub_sat;
-      break;
-    case 4:
-      ID = Intrinsic::smax;
-      break;
-    case 5:
-      ID = Intrinsic::smin;
-      break;
-    case 6:
-      ID = Intrinsic::umax;
-      break;
-    case 7:
-      ID = Intrinsic::umin;
-      break;
-    case 8:
-      ID = Intrinsic::sshl_sat;
-      break;
-    case 9:
-      ID = Intrinsic::ushl_sat;
-      break;
-    default:
-      llvm::report_fatal_error("oops");
-    }
+    Intrinsic::ID ID = pick(SatIntrinsics);
+    note(intrinsicFeature(ID));
     Value *L, *R;
     gen2(L, R, Budget, Width);
     Value *V = Builder->CreateBinaryIntrinsic(ID, L, R);
@@ -659,8 +1300,9 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
   // TODO: add fixed point intrinsics?
 
 #if LLVM_VERSION_MAJOR >= 10
-  if (Width == W && GenerateFreeze && Budget > 0 && Choose(2)) {
+  if (Width == W && GenerateFreeze && GenFreeze && Budget > 0 && Choose(2)) {
     --Budget;
+    note("freeze");
     return Builder->CreateFreeze(genVal(Budget, W, false));
   }
 #endif
@@ -670,8 +1312,18 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
    * not consuming budget
    */
 
+  if (ExactInsns && Budget > 0 && PendingSlots == 0)
+    prune();
+  if (insnsNeeded() > 0 && PendingSlots == 0)
+    prune();
+
   if (ConstOK && Choose(2)) {
-    if (FewConsts) {
+    if (SymbolicConsts && Width == W) {
+      auto *A = new Argument(Type::getIntNTy(C, W),
+                             "c" + std::to_string(ConstArgs.size()));
+      ConstArgs.push_back(A);
+      return A;
+    } else if (FewConsts) {
       int n = Choose(GenerateUndef ? 9 : 8);
       switch (n) {
       case 0:
@@ -712,9 +1364,9 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
 
   if (ArgOK && Choose(2)) {
     /*
-     * refer to a function argument; the function arguments are
-     * pre-populated because it's hard to change a function signature
-     * in LLVM
+     * refer to a function argument; these are placeholders until the
+     * function is finished, since it's hard to change a function
+     * signature in LLVM
      *
      * there's a bit of extra complixity here because we don't want to
      * gratuitously use the different function arguments just to use
@@ -724,15 +1376,16 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
      */
     std::vector<Value *> Vs;
     bool found = false;
-    for (auto a : Args) {
-      if (a->getType()->getPrimitiveSizeInBits() != (unsigned)Width)
+    for (unsigned i = 0; i < Args.size(); ++i) {
+      if (ArgWidths[i] != Width)
         continue;
-      Vs.push_back(a);
-      if (UsedArgs.find(a) == UsedArgs.end()) {
-        UsedArgs.insert(a);
+      if (!Args[i]) {
+        Args[i] = new Argument(Type::getIntNTy(C, Width));
+        Vs.push_back(Args[i]);
         found = true;
         break;
       }
+      Vs.push_back(Args[i]);
     }
     /*
      * this isn't supposed to happen since we attempt to pre-populate
@@ -746,220 +1399,2047 @@ Value *genVal(int &Budget, int Width, bool ConstOK, bool ArgOK) {
 
   std::vector<Value *> Vs;
   for (auto &it : Vals)
-    if (it->getType()->getPrimitiveSizeInBits() == (unsigned)Width)
+    if (it->getType()->getPrimitiveSizeInBits() == (unsigned)Width &&
+        (!DT || DT->dominates(cast<Instruction>(it)->getParent(), UseBlock)))
       Vs.push_back(it);
   // this can happen when no values have been created yet, no big deal
   if (Vs.size() == 0)
-    exit(0);
+    prune();
   return Vs.at(Choose(Vs.size()));
 }
 
-BasicBlock *chooseTarget(BasicBlock *Avoid = 0) {
-  std::vector<inst_iterator> targets;
-  auto i = inst_begin(F), ie = inst_end(F);
-  ++i;
-  for (; i != ie; ++i)
-    if (!i->isTerminator())
-      targets.push_back(i);
-  auto t = targets[Choose(targets.size())];
-  Instruction *I = &*t;
-  BasicBlock *BB;
-  if (I == &*I->getParent()->getFirstInsertionPt()) {
-    BB = I->getParent();
-  } else {
-    BB = I->getParent()->splitBasicBlock(I, "spl");
+/*
+ * a CFG shape for --branches lists the successors of each block in
+ * increasing order: no successors means the block returns, a
+ * successor after the block is a forward edge, and one at or before
+ * it is a back edge. shapes are enumerated once, up front, so that
+ * generate() only ever builds valid CFGs
+ */
+typedef std::vector<std::vector<int>> Shape;
+std::vector<Shape> Shapes;
+
+bool hasBackEdge(const Shape &S) {
+  for (unsigned b = 0; b < S.size(); ++b)
+    for (int s : S[b])
+      if (s <= (int)b)
+        return true;
+  return false;
+}
+
+/*
+ * the entry block has no predecessors, every other block has a
+ * forward one (so everything is reachable), and a branch has a
+ * forward target (so everything can reach a return)
+ */
+bool validShape(const Shape &S) {
+  for (unsigned b = 0; b < S.size(); ++b) {
+    auto &Succs = S[b];
+    if (Succs.size() == 2 && Succs[0] == Succs[1])
+      return false;
+    int Fwd = 0, Back = 0;
+    for (int s : Succs) {
+      if (s == 0)
+        return false;
+      if (s > (int)b)
+        ++Fwd;
+      else
+        ++Back;
+    }
+    if (!Succs.empty() && Fwd == 0)
+      return false;
+    if (Back && !Loops)
+      return false;
+    if (b == 0)
+      continue;
+    bool Reached = false;
+    for (unsigned p = 0; p < b; ++p)
+      for (int s : S[p])
+        Reached |= s == (int)b;
+    if (!Reached)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * of all the ways to lay out isomorphic shapes, keep only the least
+ * one; the order of a conditional branch's targets doesn't matter
+ * since the condition can always be inverted
+ */
+bool canonicalShape(const Shape &S) {
+  std::vector<int> Perm(S.size());
+  std::iota(Perm.begin(), Perm.end(), 0);
+  while (std::next_permutation(Perm.begin() + 1, Perm.end())) {
+    Shape T(S.size());
+    for (unsigned b = 0; b < S.size(); ++b) {
+      for (int s : S[b])
+        T[Perm[b]].push_back(Perm[s]);
+      std::sort(T[Perm[b]].begin(), T[Perm[b]].end());
+    }
+    if (T < S && validShape(T))
+      return false;
   }
-  return BB;
+  return true;
 }
 
-std::vector<Value *> globs;
+void enumShapes(Shape &S, unsigned b) {
+  if (b == S.size()) {
+    if (validShape(S) && canonicalShape(S))
+      Shapes.push_back(S);
+    return;
+  }
+  int K = S.size();
+  S[b] = {};
+  enumShapes(S, b + 1);
+  for (int i = 1; i < K; ++i) {
+    S[b] = {i};
+    enumShapes(S, b + 1);
+    for (int j = i + 1; j < K; ++j) {
+      S[b] = {i, j};
+      enumShapes(S, b + 1);
+    }
+  }
+}
 
-void makeArg(int W, std::vector<Type *> &ArgsTy,
-             std::vector<Type *> &RealArgsTy) {
-  int RealW = W;
-  if (Promote != -1 && Promote > W)
-    RealW = Promote;
-  ArgsTy.push_back(IntegerType::getIntNTy(C, W));
-  auto T = IntegerType::getIntNTy(C, RealW);
-  RealArgsTy.push_back(T);
-  if (ArgsFromMem) {
-    GlobalVariable *g =
-        new GlobalVariable(*M, T, /*isConstant=*/false,
-                           /*Linkage=*/GlobalValue::ExternalLinkage,
-                           /*Initializer=*/0);
-    globs.push_back(g);
+// whether some shape has a block other than the entry that a phi can go in
+bool shapesHaveJoin() {
+  for (auto &S : Shapes) {
+    std::vector<int> Preds(S.size());
+    for (auto &Succs : S)
+      for (int s : Succs)
+        if (s != 0 && ++Preds[s] > 1)
+          return true;
   }
+  return false;
 }
 
-void addArg(Value *a, int W, std::vector<Type *> &ArgsTy) {
-  assert(a);
-  if (Promote != -1 && Promote > W)
-    Args.push_back(Builder->CreateTrunc(a, IntegerType::getIntNTy(C, W)));
-  else
-    Args.push_back(a);
+void setupShapes() {
+  if (!Branch) {
+    Shapes.push_back(Shape(1));
+    return;
+  }
+  if (NumBlocks < 1 || NumBlocks > 5)
+    die("--num-blocks must be between 1 and 5");
+  for (int K = 1; K <= NumBlocks; ++K) {
+    Shape S(K);
+    enumShapes(S, 0);
+  }
+  std::stable_sort(Shapes.begin(), Shapes.end(),
+                   [](const Shape &A, const Shape &B) {
+                     return hasBackEdge(A) < hasBackEdge(B);
+                   });
 }
 
-void generate() {
-  M = new Module("", C);
-  if (ARM64) {
-    M->setTargetTriple("aarch64-unknown-linux-gnu");
-    M->setDataLayout("e-m:e-i8:8:32-i16:16:32-i64:64-i128:128-n32:64-S128");
+Type *realArgType(int Width) {
+  if (Promote != -1 && Promote > Width)
+    return IntegerType::getIntNTy(C, Promote);
+  return IntegerType::getIntNTy(C, Width);
+}
+
+/*
+ * generate() builds the body in a host function without parameters;
+ * now that we know which inputs are used, move it into a function
+ * that takes exactly those (or all of them with
+ * --remove-unused-args=false), followed by the symbolic constants
+ */
+void finishSignature(Type *RetTy) {
+  std::vector<unsigned> Inputs;
+  for (unsigned i = 0; i < Args.size(); ++i)
+    if (!RemoveUnusedArgs || (Args[i] && !Args[i]->use_empty()))
+      Inputs.push_back(i);
+
+  std::vector<Type *> ParamsTy;
+  if (!ArgsFromMem)
+    for (unsigned i : Inputs)
+      ParamsTy.push_back(realArgType(ArgWidths[i]));
+  for (auto *A : ConstArgs)
+    ParamsTy.push_back(A->getType());
+  auto *Real = Function::Create(FunctionType::get(RetTy, ParamsTy, false),
+                                GlobalValue::ExternalLinkage, "");
+  M->getFunctionList().insert(F->getIterator(), Real);
+  Real->takeName(F);
+  Real->getBasicBlockList().splice(Real->end(), F->getBasicBlockList());
+  F->eraseFromParent();
+  F = Real;
+
+  Builder->SetInsertPoint(&F->getEntryBlock(), F->getEntryBlock().begin());
+  for (unsigned n = 0; n < Inputs.size(); ++n) {
+    unsigned i = Inputs[n];
+    Type *T = realArgType(ArgWidths[i]);
+    Value *V;
+    if (ArgsFromMem) {
+      auto *G = new GlobalVariable(*M, T, /*isConstant=*/false,
+                                   /*Linkage=*/GlobalValue::ExternalLinkage,
+                                   /*Initializer=*/0);
+      V = Builder->CreateLoad(T, G);
+    } else {
+      V = F->getArg(n);
+    }
+    if (!Args[i] || Args[i]->use_empty())
+      continue;
+    if (T != Args[i]->getType())
+      V = Builder->CreateTrunc(V, Args[i]->getType());
+    Args[i]->replaceAllUsesWith(V);
   }
-  std::vector<Type *> ArgsTy, RealArgsTy, MT;
-  for (int i = 0; i < N + 2; ++i) {
-    makeArg(W, ArgsTy, RealArgsTy);
-    makeArg(W, ArgsTy, RealArgsTy);
-    makeArg(1, ArgsTy, RealArgsTy);
-    makeArg(W / 2, ArgsTy, RealArgsTy);
-    makeArg(W * 2, ArgsTy, RealArgsTy);
+  for (unsigned n = 0; n < ConstArgs.size(); ++n) {
+    Argument *A = F->getArg(ParamsTy.size() - ConstArgs.size() + n);
+    A->takeName(ConstArgs[n]);
+    ConstArgs[n]->replaceAllUsesWith(A);
+    ConstArgs[n]->deleteValue();
+    ConstArgs[n] = A;
   }
+  for (auto *A : Args)
+    if (A)
+      A->deleteValue();
+  Args.clear();
+}
+
+void generate() {
+  M = new Module("", C);
+  // with --branches every block may need a few more leaves
+  int NumArgs = N + 2 + (Branch ? 2 * NumBlocks : 0);
+  for (int i = 0; i < NumArgs; ++i)
+    for (int Width : {(int)W, (int)W, 1, W / 2, W * 2})
+      ArgWidths.push_back(Width);
+  Args.assign(ArgWidths.size(), nullptr);
   int RetWidth = Geni1 ? 1 : W;
   if (Promote != -1 && Promote > RetWidth)
     RetWidth = Promote;
-  auto FuncTy = FunctionType::get(Type::getIntNTy(C, RetWidth),
-                                  ArgsFromMem ? MT : RealArgsTy, 0);
-  F = Function::Create(FuncTy, GlobalValue::ExternalLinkage, BaseName, M);
-  BBs.push_back(BasicBlock::Create(C, "", F));
+  auto RetTy = Type::getIntNTy(C, RetWidth);
+  F = Function::Create(FunctionType::get(RetTy, false),
+                       GlobalValue::ExternalLinkage, BaseName, M);
+
+  /*
+   * the CFG is built first, with placeholder conditions and return
+   * values, so that its dominator tree is known while the straight
+   * line code is generated
+   */
+  const Shape &S = Shapes.size() > 1 ? Shapes[Choose(Shapes.size())] : Shapes[0];
+  for (unsigned b = 0; b < S.size(); ++b)
+    BBs.push_back(BasicBlock::Create(C, "", F));
   Builder = new IRBuilder<NoFolder>(BBs[0]);
+  for (unsigned b = 0; b < S.size(); ++b) {
+    Builder->SetInsertPoint(BBs[b]);
+    if (S[b].empty())
+      Builder->CreateRet(UndefValue::get(RetTy));
+    else if (S[b].size() == 1)
+      Builder->CreateBr(BBs[S[b][0]]);
+    else
+      Builder->CreateCondBr(UndefValue::get(Type::getInt1Ty(C)),
+                            BBs[S[b][0]], BBs[S[b][1]]);
+  }
+  if (S.size() > 1)
+    DT = new DominatorTree(*F);
   int Budget = N;
-  Builder->SetInsertPoint(BBs[0]);
 
-  if (ArgsFromMem) {
-    for (unsigned i = 0; i < ArgsTy.size(); ++i) {
-      Value *a = Builder->CreateLoad(RealArgsTy.at(i), globs.at(i));
-      int W = ArgsTy.at(i)->getPrimitiveSizeInBits();
-      addArg(a, W, ArgsTy);
-    }
-  } else {
-    unsigned i = 0;
-    for (auto it = F->arg_begin(); it != F->arg_end(); ++i, ++it) {
-      int W = ArgsTy.at(i)->getPrimitiveSizeInBits();
-      addArg(it, W, ArgsTy);
+  // a block with several predecessors may start with a phi
+  std::vector<int> Preds(S.size());
+  for (auto &Succs : S)
+    for (int s : Succs)
+      ++Preds[s];
+  std::vector<PHINode *> Phis(S.size());
+  for (unsigned b = 1; b < S.size(); ++b) {
+    if (Preds[b] > 1 && Budget > 0 && GenPhi && Choose(2)) {
+      --Budget;
+      note("phi");
+      Builder->SetInsertPoint(BBs[b], BBs[b]->begin());
+      Phis[b] = Builder->CreatePHI(Type::getIntNTy(C, W), Preds[b]);
+      Vals.push_back(Phis[b]);
     }
   }
+  // phis only go at the top of blocks, so there won't be another chance
+  if (Unmet.lookup("phi") > 0)
+    ++Unmeetable;
 
-  // the magic happens in genVal()
-  Value *V;
-  if (Geni1)
-    V = genVal(Budget, 1, false, false);
-  else
-    V = genVal(Budget, W, false, false);
-
-  if ((unsigned)RetWidth > V->getType()->getPrimitiveSizeInBits())
-    V = Builder->CreateZExt(V, IntegerType::getIntNTy(C, Promote));
-  // terminate the only non-terminated BB
-  Builder->CreateRet(V);
-
-  // fixup branch targets
-  for (auto &bi : Branches) {
-    BasicBlock *BB1 = chooseTarget();
-    bi->setSuccessor(0, BB1);
-    if (bi->isConditional())
-      bi->setSuccessor(1, chooseTarget(BB1));
-  }
-
-// finally, fixup the Phis -- first by splitting any BBs where a non-Phi
-// precedes a Phi
-redo:
-  for (auto &bb : *F) {
-    bool notphi = false;
-    for (auto &i : bb) {
-      if (!isa<PHINode>(i))
-        notphi = true;
-      if (notphi && isa<PHINode>(i)) {
-        i.getParent()->splitBasicBlock(&i, "phisp");
-        goto redo;
-      }
-    }
+  /*
+   * each block computes the value it passes to its successors' phis,
+   * its branch condition, or its return value -- whichever apply.
+   * these are all generated up front for --exact-insns
+   */
+  std::vector<bool> FeedsPhi(S.size());
+  for (unsigned b = 0; b < S.size(); ++b) {
+    for (int s : S[b])
+      if (Phis[s])
+        FeedsPhi[b] = true;
+    PendingSlots += FeedsPhi[b] + (S[b].size() == 2) + S[b].empty();
   }
 
-  // and second by giving them incoming edges
-  for (auto p = inst_begin(F), pe = inst_end(F); p != pe; ++p) {
-    PHINode *P = dyn_cast<PHINode>(&*p);
-    if (!P)
-      continue;
-    BasicBlock *BB = P->getParent();
-    for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI) {
-      BasicBlock *Pred = *PI;
-      assert(Budget == 0);
-      Value *V =
-          genVal(Budget, P->getType()->getPrimitiveSizeInBits(), true, false);
-      P->addIncoming(V, Pred);
-    }
-  }
-
-  // drop any program where we have a non-entry BB that lacks predecessors;
-  // would be better to avoid creating these in the first place
-  bool first = true;
-  for (auto &bb : *F) {
-    if (first) {
-      first = false;
-    } else {
-      int p = 0;
-      for (pred_iterator PI = pred_begin(&bb), E = pred_end(&bb); PI != E; ++PI)
-        p++;
-      if (p == 0) {
-        // under what circumstances can this happen?
-        exit(0);
-      }
+  // the magic happens in genVal()
+  std::vector<Value *> Out(S.size());
+  for (unsigned b = 0; b < S.size(); ++b) {
+    UseBlock = BBs[b];
+    Instruction *T = BBs[b]->getTerminator();
+    Builder->SetInsertPoint(T);
+    if (FeedsPhi[b]) {
+      --PendingSlots;
+      Out[b] = genVal(Budget, W, true);
+    }
+    if (S[b].size() == 2) {
+      --PendingSlots;
+      cast<BranchInst>(T)->setCondition(genVal(Budget, 1, false));
+    }
+    if (S[b].empty()) {
+      --PendingSlots;
+      Value *V = genVal(Budget, Geni1 ? 1 : W, false, false);
+      if ((unsigned)RetWidth > V->getType()->getPrimitiveSizeInBits())
+        V = Builder->CreateZExt(V, RetTy);
+      T->setOperand(0, V);
     }
   }
-}
+  assert(!ExactInsns || Budget == 0);
+  if (!requirementsMet())
+    prune();
 
-void removeDeadArguments() {
-  std::vector<Function *> Funcs;
-  for (auto &F : *M)
-    if (!F.arg_empty() && !F.isIntrinsic())
-      Funcs.push_back(&F);
+  // now every incoming value is known
+  for (unsigned b = 0; b < S.size(); ++b)
+    for (int s : S[b])
+      if (Phis[s])
+        Phis[s]->addIncoming(Out[b], BBs[b]);
 
-  for (auto *F : Funcs) {
-    ValueToValueMapTy VMap;
-    std::vector<WeakVH> InstToDelete;
-    for (auto &A : F->args())
-      if (A.getNumUses() < 1)
-        VMap[&A] = UndefValue::get(A.getType());
-    
-    // No arguments to remove
-    if (VMap.empty())
-      continue;
+  delete DT;
+  DT = nullptr;
+  finishSignature(RetTy);
+}
 
-    auto *ClonedFunc = CloneFunction(F, VMap);
-    ClonedFunc->removeFromParent();
-    M->getFunctionList().insertAfter(F->getIterator(), ClonedFunc);
+/*
+ * in-process optimization: the pipeline is parsed once in the root
+ * process and every descendant inherits it across fork()
+ */
+struct Pipeline {
+  std::string Text;
+  PassInstrumentationCallbacks PIC;
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  ModulePassManager MPM;
+  // for --time-compile: nanoseconds spent in each pass, and in the
+  // pipeline as a whole, during run()
+  StringMap<long> PassTimes;
+  long RunTime = 0;
+  std::vector<std::chrono::steady_clock::time_point> Starts;
 
-    auto FName = std::string(F->getName());
-    F->eraseFromParent();
-    ClonedFunc->setName(FName);
+  Pipeline(StringRef T)
+      : Text(T), PB(nullptr, PipelineTuningOptions(), None, &PIC) {
+    if (TimeCompile)
+      timePasses();
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    if (auto Err = PB.parsePassPipeline(MPM, T))
+      die(("can't parse pipeline: " + toString(std::move(Err))).c_str());
   }
 
-}
+  // pass managers and adaptors are accounted to the passes they run
+  void timePasses() {
+    PIC.registerBeforeNonSkippedPassCallback([this](StringRef, Any) {
+      Starts.push_back(std::chrono::steady_clock::now());
+    });
+    auto Stop = [this](StringRef P) {
+      auto Time = std::chrono::steady_clock::now() - Starts.back();
+      Starts.pop_back();
+      if (!isSpecialPass(P, {"PassManager", "PassAdaptor"}))
+        PassTimes[P] +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Time).count();
+    };
+    PIC.registerAfterPassCallback(
+        [Stop](StringRef P, Any, const PreservedAnalyses &) { Stop(P); });
+    PIC.registerAfterPassInvalidatedCallback(
+        [Stop](StringRef P, const PreservedAnalyses &) { Stop(P); });
+  }
 
-void output() {
-  std::string SStr;
-  raw_string_ostream SS(SStr);
-  legacy::PassManager Passes;
-  // Passes.add(createDeadCodeEliminationPass());
-  if (RemoveUnusedArgs)
-    removeDeadArguments();
-  if (Verify)
-    Passes.add(createVerifierPass());
-  Passes.add(createPrintModulePass(SS));
-  Passes.run(*M);
-
-  std::string func = SS.str();
+  void run(Module &Mod) {
+    PassTimes.clear();
+    auto Start = std::chrono::steady_clock::now();
+    MPM.run(Mod, MAM);
+    RunTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - Start)
+                  .count();
+    // cached results refer to IR that's about to go away
+    MAM.clear();
+    CGAM.clear();
+    FAM.clear();
+    LAM.clear();
+  }
+};
+
+// --passes, and --compare-passes
+Pipeline *Opt, *Opt2;
+
+/*
+ * the verifier worker protocol: every message is a 4-byte big-endian
+ * length followed by that many bytes. for each function we send three
+ * messages -- the function's name, the original module, and the
+ * optimized module (empty unless --passes was given) -- and the worker
+ * answers with one message whose first line is OK, FAIL, or ERROR and
+ * whose remainder is a free-form log
+ */
+
+bool writeAll(int fd, const char *Buf, size_t Len) {
+  while (Len > 0) {
+    ssize_t res = write(fd, Buf, Len);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    Buf += res;
+    Len -= res;
+  }
+  return true;
+}
+
+bool readAll(int fd, char *Buf, size_t Len) {
+  while (Len > 0) {
+    ssize_t res = read(fd, Buf, Len);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    Buf += res;
+    Len -= res;
+  }
+  return true;
+}
+
+bool sendMsg(int fd, const std::string &S) {
+  uint32_t Len = S.length();
+  unsigned char Hdr[4] = {(unsigned char)(Len >> 24), (unsigned char)(Len >> 16),
+                          (unsigned char)(Len >> 8), (unsigned char)Len};
+  return writeAll(fd, (const char *)Hdr, 4) &&
+         writeAll(fd, S.data(), S.length());
+}
+
+bool recvMsg(int fd, std::string &S) {
+  unsigned char Hdr[4];
+  if (!readAll(fd, (char *)Hdr, 4))
+    return false;
+  uint32_t Len = (Hdr[0] << 24) | (Hdr[1] << 16) | (Hdr[2] << 8) | Hdr[3];
+  S.resize(Len);
+  return readAll(fd, &S[0], Len);
+}
+
+struct Worker {
+  int In, Out;
+  pid_t Pid;
+};
+std::vector<Worker> Workers;
+
+void setCloExec(int fd) {
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+    die("fcntl failed");
+}
+
+/*
+ * the workers are started by the root process before anything else
+ * is forked, so every descendant inherits the pipes to all of them;
+ * Shmem->WorkerBusy says who is talking to which worker
+ */
+void startWorkers() {
+  int Jobs = VerifierJobs == -1 ? Cores : VerifierJobs;
+  if (Jobs < 1 || Jobs > MAX_WORKERS)
+    die("--verifier-jobs out of range");
+  for (int i = 0; i < Jobs; ++i) {
+    int ToW[2], FromW[2];
+    if (::pipe(ToW) != 0 || ::pipe(FromW) != 0)
+      die("pipe failed");
+    pid_t pid = ::fork();
+    if (pid == -1)
+      die("fork failed");
+    if (pid == 0) {
+      ::dup2(ToW[0], 0);
+      ::dup2(FromW[1], 1);
+      ::close(ToW[0]);
+      ::close(ToW[1]);
+      ::close(FromW[0]);
+      ::close(FromW[1]);
+      ::execl("/bin/sh", "sh", "-c", VerifierCmd.c_str(), (char *)nullptr);
+      ::_exit(127);
+    }
+    ::close(ToW[0]);
+    ::close(FromW[1]);
+    setCloExec(ToW[1]);
+    setCloExec(FromW[0]);
+    Workers.push_back({ToW[1], FromW[0], pid});
+  }
+}
+
+void stopWorkers() {
+  for (auto &Wk : Workers)
+    ::close(Wk.In);
+  for (auto &Wk : Workers) {
+    ::close(Wk.Out);
+    waitpid(Wk.Pid, 0, 0);
+  }
+}
+
+std::string verifyOnSocket(const std::string &Name, const std::string &Src,
+                           const std::string &Tgt) {
+  struct sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (VerifierSocket.length() >= sizeof(Addr.sun_path))
+    die("--verifier-socket path is too long");
+  strcpy(Addr.sun_path, VerifierSocket.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    die("socket failed");
+  if (connect(fd, (struct sockaddr *)&Addr, sizeof(Addr)) != 0)
+    die("can't connect to --verifier-socket");
+  std::string Reply;
+  if (!sendMsg(fd, Name) || !sendMsg(fd, Src) || !sendMsg(fd, Tgt) ||
+      !recvMsg(fd, Reply))
+    Reply = "ERROR\nlost connection to the verifier socket\n";
+  ::close(fd);
+  return Reply;
+}
+
+std::string verifyWithWorker(const std::string &Name, const std::string &Src,
+                             const std::string &Tgt) {
+  if (pthread_mutex_lock(&Shmem->Lock) != 0)
+    die("lock failed");
+  int Idx = -1;
+  while (true) {
+    if (Shmem->Stop)
+      leave();
+    for (unsigned i = 0; i < Workers.size(); ++i) {
+      if (!Shmem->WorkerBusy[i]) {
+        Idx = i;
+        break;
+      }
+    }
+    if (Idx != -1)
+      break;
+    if (pthread_cond_wait(&Shmem->WorkerCond, &Shmem->Lock))
+      die("pthread_cond_wait failed");
+  }
+  Shmem->WorkerBusy[Idx] = true;
+  if (pthread_mutex_unlock(&Shmem->Lock) != 0)
+    die("unlock failed");
+
+  std::string Reply;
+  auto &Wk = Workers[Idx];
+  // the worker's state is unknown after a short read, so give up
+  if (!sendMsg(Wk.In, Name) || !sendMsg(Wk.In, Src) || !sendMsg(Wk.In, Tgt) ||
+      !recvMsg(Wk.Out, Reply))
+    die("lost contact with a verifier worker");
+
+  if (pthread_mutex_lock(&Shmem->Lock) != 0)
+    die("lock failed");
+  Shmem->WorkerBusy[Idx] = false;
+  if (pthread_cond_signal(&Shmem->WorkerCond) != 0)
+    die("pthread_cond_signal failed");
+  if (pthread_mutex_unlock(&Shmem->Lock) != 0)
+    die("unlock failed");
+  return Reply;
+}
+
+bool useVerifier() { return !VerifierCmd.empty() || !VerifierSocket.empty(); }
+
+void writeFile(const std::string &FN, const std::string &Text) {
+  int fd = open(FN.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  if (fd < 2)
+    die("open failed");
+  if (!writeAll(fd, Text.c_str(), Text.length()))
+    die("write failed");
+  int res = close(fd);
+  assert(res == 0);
+}
+
+/*
+ * printing through the AsmWriter is general, and slow for what we
+ * need: this prints the small subset of IR that opt-fuzz generates,
+ * in exactly the same format. print() returns false as soon as it
+ * sees anything outside the subset, and then the caller falls back
+ * to the AsmWriter
+ */
+class FastPrinter {
+  std::string &Out;
+  DenseMap<const Value *, unsigned> GlobalSlots, LocalSlots;
+  std::vector<AttributeSet> AttrGroups;
+
+  static bool plainName(StringRef Name) {
+    if (Name.empty() || isDigit(Name[0]))
+      return false;
+    for (char c : Name)
+      if (!isAlnum(c) && c != '-' && c != '$' && c != '.' && c != '_')
+        return false;
+    return true;
+  }
+
+  bool type(Type *T) {
+    if (auto *IT = dyn_cast<IntegerType>(T)) {
+      Out += 'i';
+      Out += utostr(IT->getBitWidth());
+      return true;
+    }
+    if (T->isVoidTy()) {
+      Out += "void";
+      return true;
+    }
+    auto *ST = dyn_cast<StructType>(T);
+    if (!ST || !ST->isLiteral() || ST->isPacked())
+      return false;
+    if (ST->getNumElements() == 0) {
+      Out += "{}";
+      return true;
+    }
+    Out += "{ ";
+    for (unsigned i = 0; i < ST->getNumElements(); ++i) {
+      if (i)
+        Out += ", ";
+      if (!type(ST->getElementType(i)))
+        return false;
+    }
+    Out += " }";
+    return true;
+  }
+
+  bool operand(const Value *V) {
+    if (auto *CI = dyn_cast<ConstantInt>(V)) {
+      if (CI->getType()->isIntegerTy(1))
+        Out += CI->isZero() ? "false" : "true";
+      else
+        Out += toString(CI->getValue(), 10, /*Signed=*/true);
+      return true;
+    }
+    if (isa<PoisonValue>(V)) {
+      Out += "poison";
+      return true;
+    }
+    if (isa<UndefValue>(V)) {
+      Out += "undef";
+      return true;
+    }
+    bool Global = isa<GlobalValue>(V);
+    if (!Global && !isa<Argument>(V) && !isa<Instruction>(V) &&
+        !isa<BasicBlock>(V))
+      return false;
+    Out += Global ? '@' : '%';
+    if (V->hasName()) {
+      if (!plainName(V->getName()))
+        return false;
+      Out += V->getName();
+      return true;
+    }
+    auto &Slots = Global ? GlobalSlots : LocalSlots;
+    auto It = Slots.find(V);
+    if (It == Slots.end())
+      return false;
+    Out += utostr(It->second);
+    return true;
+  }
+
+  bool typedOperand(const Value *V) {
+    if (!type(V->getType()))
+      return false;
+    Out += ' ';
+    return operand(V);
+  }
+
+  unsigned attrGroup(AttributeSet AS) {
+    auto It = std::find(AttrGroups.begin(), AttrGroups.end(), AS);
+    if (It != AttrGroups.end())
+      return It - AttrGroups.begin();
+    AttrGroups.push_back(AS);
+    return AttrGroups.size() - 1;
+  }
+
+  bool instruction(const Instruction &I) {
+    if (I.hasMetadata())
+      return false;
+    Out += "  ";
+    if (!I.getType()->isVoidTy()) {
+      if (!operand(&I))
+        return false;
+      Out += " = ";
+    }
+    if (auto *B = dyn_cast<BinaryOperator>(&I)) {
+      Out += I.getOpcodeName();
+      if (isa<OverflowingBinaryOperator>(B)) {
+        if (B->hasNoUnsignedWrap())
+          Out += " nuw";
+        if (B->hasNoSignedWrap())
+          Out += " nsw";
+      } else if (isa<PossiblyExactOperator>(B) && B->isExact()) {
+        Out += " exact";
+      }
+      Out += ' ';
+      if (!typedOperand(B->getOperand(0)))
+        return false;
+      Out += ", ";
+      return operand(B->getOperand(1));
+    }
+    if (auto *Cmp = dyn_cast<ICmpInst>(&I)) {
+      Out += "icmp ";
+      Out += CmpInst::getPredicateName(Cmp->getPredicate());
+      Out += ' ';
+      if (!typedOperand(Cmp->getOperand(0)))
+        return false;
+      Out += ", ";
+      return operand(Cmp->getOperand(1));
+    }
+    if (isa<TruncInst>(I) || isa<ZExtInst>(I) || isa<SExtInst>(I)) {
+      Out += I.getOpcodeName();
+      Out += ' ';
+      if (!typedOperand(I.getOperand(0)))
+        return false;
+      Out += " to ";
+      return type(I.getType());
+    }
+    if (isa<SelectInst>(I) || isa<FreezeInst>(I) || isa<ReturnInst>(I)) {
+      Out += I.getOpcodeName();
+      if (I.getNumOperands() == 0) {
+        Out += " void";
+        return true;
+      }
+      for (unsigned i = 0; i < I.getNumOperands(); ++i) {
+        Out += i ? ", " : " ";
+        if (!typedOperand(I.getOperand(i)))
+          return false;
+      }
+      return true;
+    }
+    if (auto *EV = dyn_cast<ExtractValueInst>(&I)) {
+      Out += "extractvalue ";
+      if (!typedOperand(EV->getAggregateOperand()))
+        return false;
+      for (unsigned Idx : EV->indices()) {
+        Out += ", ";
+        Out += utostr(Idx);
+      }
+      return true;
+    }
+    if (auto *Call = dyn_cast<CallInst>(&I)) {
+      auto *Callee = Call->getCalledFunction();
+      if (!Callee || Call->isTailCall() || !Call->getAttributes().isEmpty() ||
+          Call->getCallingConv() != CallingConv::C ||
+          Call->hasOperandBundles() || Callee->isVarArg() ||
+          Callee->getFunctionType() != Call->getFunctionType())
+        return false;
+      Out += "call ";
+      if (!type(Call->getType()))
+        return false;
+      Out += ' ';
+      if (!operand(Callee))
+        return false;
+      Out += '(';
+      for (unsigned i = 0; i < Call->arg_size(); ++i) {
+        if (i)
+          Out += ", ";
+        if (!typedOperand(Call->getArgOperand(i)))
+          return false;
+      }
+      Out += ')';
+      return true;
+    }
+    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+      auto *G = dyn_cast<GlobalVariable>(Load->getPointerOperand());
+      // this writes the typed-pointer syntax, "i8* @g"
+      if (!G || !Load->isSimple() || G->getAddressSpace() != 0 ||
+          G->getType()->isOpaquePointerTy())
+        return false;
+      Out += "load ";
+      if (!type(Load->getType()))
+        return false;
+      Out += ", ";
+      if (!type(G->getValueType()))
+        return false;
+      Out += "* ";
+      if (!operand(G))
+        return false;
+      Out += ", align ";
+      Out += utostr(Load->getAlign().value());
+      return true;
+    }
+    if (auto *Phi = dyn_cast<PHINode>(&I)) {
+      Out += "phi ";
+      if (!type(Phi->getType()))
+        return false;
+      for (unsigned i = 0; i < Phi->getNumIncomingValues(); ++i) {
+        Out += i ? ", [ " : " [ ";
+        if (!operand(Phi->getIncomingValue(i)))
+          return false;
+        Out += ", ";
+        if (!operand(Phi->getIncomingBlock(i)))
+          return false;
+        Out += " ]";
+      }
+      return true;
+    }
+    if (auto *Br = dyn_cast<BranchInst>(&I)) {
+      Out += "br ";
+      if (Br->isConditional()) {
+        if (!typedOperand(Br->getCondition()))
+          return false;
+        Out += ", ";
+      }
+      for (unsigned i = 0; i < Br->getNumSuccessors(); ++i) {
+        if (i)
+          Out += ", ";
+        Out += "label ";
+        if (!operand(Br->getSuccessor(i)))
+          return false;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  bool function(const Function &Fn) {
+    if (Fn.getLinkage() != GlobalValue::ExternalLinkage ||
+        Fn.getVisibility() != GlobalValue::DefaultVisibility ||
+        Fn.hasGlobalUnnamedAddr() || Fn.hasAtLeastLocalUnnamedAddr() ||
+        Fn.getCallingConv() != CallingConv::C || Fn.isVarArg() ||
+        Fn.hasSection() || Fn.hasGC() || Fn.hasComdat() ||
+        Fn.getAlign() || Fn.hasPersonalityFn() || Fn.hasPrefixData() ||
+        Fn.hasPrologueData() || Fn.hasMetadata() || Fn.isDSOLocal() ||
+        Fn.getAttributes().getRetAttrs().hasAttributes() ||
+        !Fn.hasName() || Fn.isMaterializable())
+      return false;
+    bool Decl = Fn.isDeclaration();
+    LocalSlots.clear();
+    unsigned Slot = 0;
+    for (auto &A : Fn.args())
+      if (!A.hasName())
+        LocalSlots[&A] = Slot++;
+    for (auto &BB : Fn) {
+      if (!BB.hasName())
+        LocalSlots[&BB] = Slot++;
+      for (auto &I : BB)
+        if (!I.getType()->isVoidTy() && !I.hasName())
+          LocalSlots[&I] = Slot++;
+    }
+
+    AttributeSet FA = Fn.getAttributes().getFnAttrs();
+    Out += '\n';
+    if (FA.hasAttributes())
+      Out += "; Function Attrs: " + FA.getAsString() + "\n";
+    Out += Decl ? "declare " : "define ";
+    if (!type(Fn.getReturnType()))
+      return false;
+    Out += ' ';
+    if (!operand(&Fn))
+      return false;
+    Out += '(';
+    for (auto &A : Fn.args()) {
+      if (A.getArgNo())
+        Out += ", ";
+      if (!type(A.getType()))
+        return false;
+      AttributeSet PA = Fn.getAttributes().getParamAttrs(A.getArgNo());
+      if (PA.hasAttributes()) {
+        // only intrinsic declarations have these
+        if (!Decl)
+          return false;
+        Out += ' ';
+        Out += PA.getAsString();
+      }
+      if (!Decl) {
+        Out += ' ';
+        if (!operand(&A))
+          return false;
+      }
+    }
+    Out += ')';
+    if (FA.hasAttributes()) {
+      Out += " #";
+      Out += utostr(attrGroup(FA));
+    }
+    if (Decl) {
+      Out += '\n';
+      return true;
+    }
+
+    Out += " {";
+    for (auto &BB : Fn) {
+      if (BB.hasName())
+        return false;
+      if (!BB.isEntryBlock()) {
+        Out += '\n';
+        size_t LineStart = Out.size();
+        Out += utostr(LocalSlots[&BB]);
+        Out += ':';
+        Out.append(std::max<int>(50 - (Out.size() - LineStart), 1), ' ');
+        Out += ';';
+        if (pred_empty(&BB)) {
+          Out += " No predecessors!";
+        } else {
+          Out += " preds = ";
+          bool First = true;
+          for (auto *Pred : predecessors(&BB)) {
+            if (!First)
+              Out += ", ";
+            First = false;
+            if (!operand(Pred))
+              return false;
+          }
+        }
+      }
+      Out += '\n';
+      for (auto &I : BB) {
+        if (!instruction(I))
+          return false;
+        Out += '\n';
+      }
+    }
+    Out += "}\n";
+    return true;
+  }
+
+public:
+  FastPrinter(std::string &Out) : Out(Out) {}
+
+  bool print(const Module &Mod) {
+    if (!Mod.getModuleIdentifier().empty() ||
+        !Mod.getSourceFileName().empty() ||
+        !Mod.getModuleInlineAsm().empty() || !Mod.named_metadata_empty() ||
+        !Mod.alias_empty() || !Mod.ifunc_empty() ||
+        !Mod.getComdatSymbolTable().empty())
+      return false;
+    if (!Mod.getDataLayoutStr().empty())
+      Out += "target datalayout = \"" + Mod.getDataLayoutStr() + "\"\n";
+    if (!Mod.getTargetTriple().empty())
+      Out += "target triple = \"" + Mod.getTargetTriple() + "\"\n";
+
+    unsigned Slot = 0;
+    for (auto &G : Mod.globals())
+      if (!G.hasName())
+        GlobalSlots[&G] = Slot++;
+    if (!Mod.global_empty())
+      Out += '\n';
+    for (auto &G : Mod.globals()) {
+      if (G.hasInitializer() || G.isConstant() ||
+          G.getLinkage() != GlobalValue::ExternalLinkage ||
+          G.getVisibility() != GlobalValue::DefaultVisibility ||
+          G.hasAtLeastLocalUnnamedAddr() || G.isThreadLocal() ||
+          G.getAddressSpace() != 0 || G.hasSection() || G.hasComdat() ||
+          G.getAlign() || G.hasAttributes() || G.hasMetadata() ||
+          G.isDSOLocal() || G.isExternallyInitialized() ||
+          G.hasPartition())
+        return false;
+      if (!operand(&G))
+        return false;
+      Out += " = external global ";
+      if (!type(G.getValueType()))
+        return false;
+      Out += '\n';
+    }
+
+    for (auto &Fn : Mod)
+      if (!function(Fn))
+        return false;
+
+    if (!AttrGroups.empty())
+      Out += '\n';
+    for (unsigned i = 0; i < AttrGroups.size(); ++i)
+      Out += "attributes #" + utostr(i) + " = { " +
+             AttrGroups[i].getAsString(/*InAttrGrp=*/true) + " }\n";
+    return true;
+  }
+};
+
+/*
+ * print Mod into Out, which is cleared first so that callers can
+ * reuse its storage
+ */
+void printModule(Module &Mod, std::string &Out) {
+  Out.clear();
+  if (!UseFastPrinter || !FastPrinter(Out).print(Mod)) {
+    Out.clear();
+    raw_string_ostream SS(Out);
+    Mod.print(SS, nullptr);
+    SS.flush();
+  }
+  if (CheckPrinter) {
+    std::string Ref;
+    raw_string_ostream SS(Ref);
+    Mod.print(SS, nullptr);
+    SS.flush();
+    if (Ref != Out) {
+      errs() << "LLVM's printer:\n" << Ref << "opt-fuzz's printer:\n" << Out;
+      die("--check-printer found a difference");
+    }
+  }
+}
+
+std::string printModule(Module &Mod) {
+  std::string Out;
+  printModule(Mod, Out);
+  return Out;
+}
+
+void renameFunc(std::string &Text, const std::string &Name) {
+  Text.replace(Text.find(BaseName), BaseName.length(), Name);
+}
+
+/*
+ * every emitted function is preceded by comments saying how it was
+ * made, and how to get it back with --replay
+ */
+void addProvenance(std::string &Text, const std::string &Note) {
+  std::string Ch = Choices;
+  if (!Ch.empty() && Ch.back() == ' ')
+    Ch.pop_back();
+  std::string P = "; opt-fuzz args:" + CommandLine + "\n";
+  P += "; opt-fuzz replay: --seed=" + std::to_string(Seed) + " --replay=\"" +
+       Ch + "\"\n";
+  P += Note;
+  Text.insert(Text.find("define "), P);
+}
+
+/*
+ * the verdict cache maps a hash of everything that determines a
+ * verdict to the verifier's reply. entries live in DIR/xx/yyyy... and
+ * are published with rename() so concurrent writers can't tear them
+ */
+std::string cacheKey(const std::string &Src, const std::string &Tgt) {
+  std::string PipelineText = Opt ? Opt->Text : "";
+  std::string Version = CheckerVersion;
+  SHA1 H;
+  for (StringRef S : {StringRef(Src), StringRef(Tgt), StringRef(PipelineText),
+                      StringRef(Version)}) {
+    H.update(std::to_string(S.size()) + ":");
+    H.update(S);
+  }
+  return toHex(H.final(), /*LowerCase=*/true);
+}
+
+std::string cachePath(const std::string &Key) {
+  return VerdictCache + "/" + Key.substr(0, 2) + "/" + Key.substr(2);
+}
+
+bool cacheLookup(const std::string &Key, std::string &Reply) {
+  auto Buf = MemoryBuffer::getFile(cachePath(Key));
+  if (!Buf)
+    return false;
+  Reply = (*Buf)->getBuffer().str();
+  return true;
+}
+
+void cacheStore(const std::string &Key, const std::string &Reply) {
+  std::string Dir = VerdictCache + "/" + Key.substr(0, 2);
+  if (::mkdir(Dir.c_str(), 0777) != 0 && errno != EEXIST)
+    die("can't create verdict cache directory");
+  std::string Tmp = cachePath(Key) + ".tmp" + std::to_string(::getpid());
+  writeFile(Tmp, Reply);
+  if (::rename(Tmp.c_str(), cachePath(Key).c_str()) != 0)
+    die("rename failed");
+}
+
+/*
+ * hand the function to the verifier (or find its verdict in the
+ * cache); only functions that aren't proven correct are written to
+ * disk, as NAME.ll (plus NAME.opt.ll if we optimized it) next to the
+ * verifier's log in NAME.log. Src and Tgt come in with the function
+ * still called BaseName
+ */
+void check(std::string Src, std::string Tgt, const std::string &Tag,
+           const std::string &Note) {
+  std::string Key, Reply;
+  if (!VerdictCache.empty()) {
+    std::string CanonSrc = Src, CanonTgt = Tgt;
+    renameFunc(CanonSrc, "f");
+    if (!CanonTgt.empty())
+      renameFunc(CanonTgt, "f");
+    Key = cacheKey(CanonSrc, CanonTgt);
+    if (cacheLookup(Key, Reply))
+      Shmem->NumCached++;
+  }
+
+  std::string Name = BaseName + std::to_string(Id) + Tag;
+  renameFunc(Src, OneFuncPerFile ? std::string("f") : Name);
+  if (!Tgt.empty())
+    renameFunc(Tgt, OneFuncPerFile ? std::string("f") : Name);
+  addProvenance(Src, Note);
+
+  if (Reply.empty()) {
+    Reply = VerifierSocket.empty() ? verifyWithWorker(Name, Src, Tgt)
+                                   : verifyOnSocket(Name, Src, Tgt);
+    // errors are often transient (timeouts, crashes) so aren't cached
+    if (!Key.empty() && Reply.compare(0, 6, "ERROR\n") != 0)
+      cacheStore(Key, Reply);
+  }
+
+  std::string Verdict = Reply.substr(0, Reply.find('\n'));
+  if (Verdict == "OK") {
+    Shmem->NumCorrect++;
+    return;
+  }
+  if (Verdict == "FAIL")
+    Shmem->NumFailed++;
+  else
+    Shmem->NumErrors++;
+  writeFile(OutDir + Name + ".ll", Src);
+  if (!Tgt.empty())
+    writeFile(OutDir + Name + ".opt.ll", Tgt);
+  writeFile(OutDir + Name + ".log", Reply);
+}
+
+/*
+ * coverage for --coverage-guided: a feature is the name of an LLVM
+ * statistic that moved (only when LLVM was built with statistics) or
+ * a structural change the pipeline made -- an instruction kind that
+ * went away, one that appeared, or a pair of them
+ */
+std::multiset<std::string> instKinds(Module &Mod) {
+  std::multiset<std::string> Kinds;
+  for (auto &Fn : Mod) {
+    for (auto &I : instructions(Fn)) {
+      std::string K = I.getOpcodeName();
+      if (isa<OverflowingBinaryOperator>(I)) {
+        if (I.hasNoUnsignedWrap())
+          K += " nuw";
+        if (I.hasNoSignedWrap())
+          K += " nsw";
+      }
+      if (isa<PossiblyExactOperator>(I) && I.isExact())
+        K += " exact";
+      if (auto *Cmp = dyn_cast<CmpInst>(&I))
+        K += " " + CmpInst::getPredicateName(Cmp->getPredicate()).str();
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        if (auto *Callee = Call->getCalledFunction())
+          K += " " + Callee->getName().str();
+      Kinds.insert(K);
+    }
+  }
+  return Kinds;
+}
+
+void recordCoverage(const std::multiset<std::string> &Before, Module &Mod) {
+  std::vector<std::string> Features;
+  for (auto &S : GetStatistics())
+    if (S.second != 0)
+      Features.push_back("stat " + S.first.str());
+
+  auto After = instKinds(Mod);
+  std::vector<std::string> Gone, New;
+  std::set_difference(Before.begin(), Before.end(), After.begin(), After.end(),
+                      std::back_inserter(Gone));
+  std::set_difference(After.begin(), After.end(), Before.begin(), Before.end(),
+                      std::back_inserter(New));
+  for (auto &G : Gone)
+    Features.push_back("-" + G);
+  for (auto &N : New)
+    Features.push_back("+" + N);
+  for (auto &G : Gone)
+    for (auto &N : New)
+      Features.push_back(G + " -> " + N);
+
+  unsigned Found = 0;
+  for (auto &Feat : Features) {
+    uint32_t H = HashBasis;
+    for (char c : Feat)
+      H = hashStep(H, c);
+    if (!Shmem->Covered[H % COV_SIZE].exchange(true))
+      ++Found;
+  }
+  Shmem->NumFeatures += Found;
+
+  // credit every subtree this function belongs to
+  uint32_t H = HashBasis;
+  for (size_t i = 0; i <= Choices.size(); ++i) {
+    if (i == 0 || Choices[i - 1] == ' ') {
+      Shmem->Leaves[H % COV_SIZE]++;
+      if (Found)
+        Shmem->Novel[H % COV_SIZE]++;
+    }
+    if (i < Choices.size())
+      H = hashStep(H, Choices[i]);
+  }
+}
+
+/*
+ * a small interpreter for --compare-passes. it knows the IR opt-fuzz
+ * generates plus the intrinsics optimizations turn it into, and tracks
+ * poison and UB. freezing poison, undef, and loops that don't finish
+ * have no single result, so inputs reaching them are skipped; anything
+ * else it doesn't know makes the function unsupported
+ */
+struct Outcome {
+  enum Kind { VALUE, POISON, UB, NONDET, UNSUPPORTED } K;
+  APInt V;
+
+  Outcome(Kind K, APInt V = APInt()) : K(K), V(V) {}
+
+  bool operator==(const Outcome &O) const {
+    return K == O.K && (K != VALUE || V == O.V);
+  }
+};
+
+class Evaluator {
+  struct Val {
+    APInt V;
+    // the overflow bit of a *.with.overflow result
+    bool Ov = false;
+    bool Poison = false;
+  };
+  Function &Fn;
+  DenseMap<const Value *, Val> Vals;
+  // why run() stopped early
+  Outcome::Kind Stopped;
+
+  bool stop(Outcome::Kind K) {
+    Stopped = K;
+    return false;
+  }
+
+  static Val poison(Type *T) {
+    if (auto *ST = dyn_cast<StructType>(T))
+      T = ST->getElementType(0);
+    return {APInt(T->getIntegerBitWidth(), 0), false, true};
+  }
+
+  bool get(const Value *V, Val &R) {
+    if (auto *CI = dyn_cast<ConstantInt>(V)) {
+      R = {CI->getValue()};
+      return true;
+    }
+    if (isa<PoisonValue>(V) && V->getType()->isIntegerTy()) {
+      R = poison(V->getType());
+      return true;
+    }
+    if (isa<UndefValue>(V))
+      return stop(Outcome::NONDET);
+    auto It = Vals.find(V);
+    if (It == Vals.end())
+      return stop(Outcome::UNSUPPORTED);
+    R = It->second;
+    return true;
+  }
+
+  bool binOp(const BinaryOperator &B, const Val &L, const Val &R, Val &Res) {
+    unsigned Width = L.V.getBitWidth();
+    bool Ov = false;
+    auto Op = B.getOpcode();
+    if (Op == Instruction::UDiv || Op == Instruction::URem ||
+        Op == Instruction::SDiv || Op == Instruction::SRem) {
+      bool Signed = Op == Instruction::SDiv || Op == Instruction::SRem;
+      if (R.Poison || R.V.isZero() ||
+          (Signed && R.V.isAllOnes() && (L.Poison || L.V.isMinSignedValue())))
+        return stop(Outcome::UB);
+      if (L.Poison) {
+        Res = poison(B.getType());
+        return true;
+      }
+      if (Op == Instruction::UDiv) {
+        Res.V = L.V.udiv(R.V);
+        Res.Poison = B.isExact() && !L.V.urem(R.V).isZero();
+      } else if (Op == Instruction::SDiv) {
+        Res.V = L.V.sdiv(R.V);
+        Res.Poison = B.isExact() && !L.V.srem(R.V).isZero();
+      } else {
+        Res.V = Signed ? L.V.srem(R.V) : L.V.urem(R.V);
+      }
+      return true;
+    }
+
+    if (L.Poison || R.Poison) {
+      Res = poison(B.getType());
+      return true;
+    }
+    switch (Op) {
+    case Instruction::Add:
+      Res.V = L.V + R.V;
+      if (B.hasNoUnsignedWrap())
+        (void)L.V.uadd_ov(R.V, Ov);
+      Res.Poison = Ov;
+      if (B.hasNoSignedWrap())
+        (void)L.V.sadd_ov(R.V, Ov);
+      Res.Poison |= Ov;
+      return true;
+    case Instruction::Sub:
+      Res.V = L.V - R.V;
+      if (B.hasNoUnsignedWrap())
+        (void)L.V.usub_ov(R.V, Ov);
+      Res.Poison = Ov;
+      if (B.hasNoSignedWrap())
+        (void)L.V.ssub_ov(R.V, Ov);
+      Res.Poison |= Ov;
+      return true;
+    case Instruction::Mul:
+      Res.V = L.V * R.V;
+      if (B.hasNoUnsignedWrap())
+        (void)L.V.umul_ov(R.V, Ov);
+      Res.Poison = Ov;
+      if (B.hasNoSignedWrap())
+        (void)L.V.smul_ov(R.V, Ov);
+      Res.Poison |= Ov;
+      return true;
+    case Instruction::Shl:
+      if (R.V.uge(Width)) {
+        Res = poison(B.getType());
+        return true;
+      }
+      Res.V = L.V.shl(R.V);
+      if (B.hasNoUnsignedWrap())
+        (void)L.V.ushl_ov(R.V, Ov);
+      Res.Poison = Ov;
+      if (B.hasNoSignedWrap())
+        (void)L.V.sshl_ov(R.V, Ov);
+      Res.Poison |= Ov;
+      return true;
+    case Instruction::LShr:
+    case Instruction::AShr:
+      if (R.V.uge(Width)) {
+        Res = poison(B.getType());
+        return true;
+      }
+      Res.V = Op == Instruction::LShr ? L.V.lshr(R.V) : L.V.ashr(R.V);
+      Res.Poison =
+          B.isExact() && L.V.countTrailingZeros() < R.V.getZExtValue();
+      return true;
+    case Instruction::And:
+      Res.V = L.V & R.V;
+      return true;
+    case Instruction::Or:
+      Res.V = L.V | R.V;
+      return true;
+    case Instruction::Xor:
+      Res.V = L.V ^ R.V;
+      return true;
+    default:
+      return stop(Outcome::UNSUPPORTED);
+    }
+  }
+
+  bool intrinsic(const IntrinsicInst &II, Val &Res) {
+    SmallVector<Val, 3> A;
+    for (auto &U : II.args()) {
+      Val X;
+      if (!get(U, X))
+        return false;
+      if (X.Poison) {
+        Res = poison(II.getType());
+        return true;
+      }
+      A.push_back(X);
+    }
+    const APInt &X = A[0].V;
+    unsigned Width = X.getBitWidth();
+    switch (II.getIntrinsicID()) {
+    case Intrinsic::ctpop:
+      Res.V = APInt(Width, X.countPopulation());
+      return true;
+    case Intrinsic::ctlz:
+    case Intrinsic::cttz:
+      Res.V = APInt(Width, II.getIntrinsicID() == Intrinsic::ctlz
+                               ? X.countLeadingZeros()
+                               : X.countTrailingZeros());
+      Res.Poison = X.isZero() && A[1].V.getBoolValue();
+      return true;
+    case Intrinsic::bswap:
+      Res.V = X.byteSwap();
+      return true;
+    case Intrinsic::bitreverse:
+      Res.V = X.reverseBits();
+      return true;
+    case Intrinsic::abs:
+      Res.V = X.abs();
+      Res.Poison = X.isMinSignedValue() && A[1].V.getBoolValue();
+      return true;
+    case Intrinsic::fshl:
+    case Intrinsic::fshr: {
+      unsigned S = A[2].V.urem(Width);
+      bool Left = II.getIntrinsicID() == Intrinsic::fshl;
+      if (S == 0)
+        Res.V = Left ? X : A[1].V;
+      else if (Left)
+        Res.V = X.shl(S) | A[1].V.lshr(Width - S);
+      else
+        Res.V = X.shl(Width - S) | A[1].V.lshr(S);
+      return true;
+    }
+    case Intrinsic::uadd_with_overflow:
+      Res.V = X.uadd_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::sadd_with_overflow:
+      Res.V = X.sadd_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::usub_with_overflow:
+      Res.V = X.usub_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::ssub_with_overflow:
+      Res.V = X.ssub_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::umul_with_overflow:
+      Res.V = X.umul_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::smul_with_overflow:
+      Res.V = X.smul_ov(A[1].V, Res.Ov);
+      return true;
+    case Intrinsic::uadd_sat:
+      Res.V = X.uadd_sat(A[1].V);
+      return true;
+    case Intrinsic::usub_sat:
+      Res.V = X.usub_sat(A[1].V);
+      return true;
+    case Intrinsic::sadd_sat:
+      Res.V = X.sadd_sat(A[1].V);
+      return true;
+    case Intrinsic::ssub_sat:
+      Res.V = X.ssub_sat(A[1].V);
+      return true;
+    case Intrinsic::sshl_sat:
+    case Intrinsic::ushl_sat:
+      if (A[1].V.uge(Width)) {
+        Res = poison(II.getType());
+        return true;
+      }
+      Res.V = II.getIntrinsicID() == Intrinsic::sshl_sat
+                  ? X.sshl_sat(A[1].V)
+                  : X.ushl_sat(A[1].V);
+      return true;
+    case Intrinsic::smax:
+      Res.V = APIntOps::smax(X, A[1].V);
+      return true;
+    case Intrinsic::smin:
+      Res.V = APIntOps::smin(X, A[1].V);
+      return true;
+    case Intrinsic::umax:
+      Res.V = APIntOps::umax(X, A[1].V);
+      return true;
+    case Intrinsic::umin:
+      Res.V = APIntOps::umin(X, A[1].V);
+      return true;
+    default:
+      return stop(Outcome::UNSUPPORTED);
+    }
+  }
+
+  bool inst(const Instruction &I, Val &Res) {
+    if (auto *II = dyn_cast<IntrinsicInst>(&I))
+      return intrinsic(*II, Res);
+    if (isa<CallInst>(I))
+      return stop(Outcome::UNSUPPORTED);
+    SmallVector<Val, 3> Ops;
+    for (auto &U : I.operands()) {
+      Val X;
+      if (!get(U, X))
+        return false;
+      Ops.push_back(X);
+    }
+    if (auto *B = dyn_cast<BinaryOperator>(&I))
+      return binOp(*B, Ops[0], Ops[1], Res);
+    if (auto *Cmp = dyn_cast<ICmpInst>(&I)) {
+      Res.V = APInt(1, ICmpInst::compare(Ops[0].V, Ops[1].V,
+                                         Cmp->getPredicate()));
+      Res.Poison = Ops[0].Poison || Ops[1].Poison;
+      return true;
+    }
+    if (isa<SelectInst>(I)) {
+      if (Ops[0].Poison)
+        Res = poison(I.getType());
+      else
+        Res = Ops[0].V.getBoolValue() ? Ops[1] : Ops[2];
+      return true;
+    }
+    if (isa<TruncInst>(I) || isa<ZExtInst>(I) || isa<SExtInst>(I)) {
+      unsigned Width = I.getType()->getIntegerBitWidth();
+      if (isa<TruncInst>(I))
+        Res.V = Ops[0].V.trunc(Width);
+      else if (isa<ZExtInst>(I))
+        Res.V = Ops[0].V.zext(Width);
+      else
+        Res.V = Ops[0].V.sext(Width);
+      Res.Poison = Ops[0].Poison;
+      return true;
+    }
+    if (isa<FreezeInst>(I)) {
+      if (Ops[0].Poison)
+        return stop(Outcome::NONDET);
+      Res = Ops[0];
+      return true;
+    }
+    if (auto *EV = dyn_cast<ExtractValueInst>(&I)) {
+      if (EV->getNumIndices() != 1)
+        return stop(Outcome::UNSUPPORTED);
+      if (EV->getIndices()[0] == 0)
+        Res.V = Ops[0].V;
+      else
+        Res.V = APInt(1, Ops[0].Ov);
+      Res.Poison = Ops[0].Poison;
+      return true;
+    }
+    return stop(Outcome::UNSUPPORTED);
+  }
+
+public:
+  Evaluator(Function &Fn) : Fn(Fn) {}
+
+  Outcome run(ArrayRef<APInt> Args) {
+    Vals.clear();
+    for (auto &A : Fn.args())
+      Vals[&A] = {Args[A.getArgNo()]};
+    const BasicBlock *BB = &Fn.getEntryBlock(), *Prev = nullptr;
+    for (unsigned Steps = 0; Steps < 10000;) {
+      // the phis at the top of a block read their inputs all at once
+      SmallVector<std::pair<const PHINode *, Val>, 2> Phis;
+      for (auto &Phi : BB->phis()) {
+        Val X;
+        if (!Prev)
+          return {Outcome::UNSUPPORTED};
+        if (!get(Phi.getIncomingValueForBlock(Prev), X))
+          return {Stopped};
+        Phis.push_back({&Phi, X});
+      }
+      for (auto &P : Phis)
+        Vals[P.first] = P.second;
+
+      const BasicBlock *Next = nullptr;
+      for (auto &I : *BB) {
+        ++Steps;
+        if (isa<PHINode>(I))
+          continue;
+        if (auto *Ret = dyn_cast<ReturnInst>(&I)) {
+          Val X;
+          if (!Ret->getReturnValue() || !get(Ret->getReturnValue(), X))
+            return {Ret->getReturnValue() ? Stopped : Outcome::UNSUPPORTED};
+          if (X.Poison)
+            return {Outcome::POISON};
+          return {Outcome::VALUE, X.V};
+        }
+        if (auto *Br = dyn_cast<BranchInst>(&I)) {
+          unsigned Succ = 0;
+          if (Br->isConditional()) {
+            Val Cond;
+            if (!get(Br->getCondition(), Cond))
+              return {Stopped};
+            if (Cond.Poison)
+              return {Outcome::UB};
+            Succ = Cond.V.isZero();
+          }
+          Next = Br->getSuccessor(Succ);
+          break;
+        }
+        if (isa<UnreachableInst>(I))
+          return {Outcome::UB};
+        Val Res;
+        if (!inst(I, Res))
+          return {Stopped};
+        Vals[&I] = Res;
+      }
+      if (!Next)
+        return {Outcome::UNSUPPORTED};
+      Prev = BB;
+      BB = Next;
+    }
+    return {Outcome::NONDET};
+  }
+};
+
+/*
+ * --compare-passes: what each pipeline left behind, and whether the
+ * two results behave alike
+ */
+struct Summary {
+  unsigned Insns = 0, Flags = 0, Attrs = 0;
+  // one "opcode flag" entry per flag, and one "where: attributes" entry
+  // per attribute set, sorted so that two pipelines that leave the
+  // same flags on the same kinds of instructions compare equal
+  std::vector<std::string> Marks;
+};
+
+void summarizeAttrs(Summary &S, AttributeList AL, const std::string &Where) {
+  for (unsigned Idx : AL.indexes()) {
+    AttributeSet AS = AL.getAttributes(Idx);
+    if (!AS.hasAttributes())
+      continue;
+    S.Attrs += AS.getNumAttributes();
+    std::string Key = Idx == AttributeList::FunctionIndex ? "fn"
+                      : Idx == AttributeList::ReturnIndex
+                          ? "ret"
+                          : "arg" + std::to_string(Idx -
+                                                   AttributeList::FirstArgIndex);
+    S.Marks.push_back(Where + Key + ": " + AS.getAsString());
+  }
+}
+
+Summary summarize(Function &Fn) {
+  Summary S;
+  auto Flag = [&](std::string Mark) {
+    S.Marks.push_back(Mark);
+    ++S.Flags;
+  };
+  summarizeAttrs(S, Fn.getAttributes(), "");
+  for (auto &I : instructions(Fn)) {
+    ++S.Insns;
+    std::string Op = I.getOpcodeName();
+    if (isa<OverflowingBinaryOperator>(I)) {
+      if (I.hasNoUnsignedWrap())
+        Flag(Op + " nuw");
+      if (I.hasNoSignedWrap())
+        Flag(Op + " nsw");
+    }
+    if (isa<PossiblyExactOperator>(I) && I.isExact())
+      Flag(Op + " exact");
+    if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+      auto ID = II->getIntrinsicID();
+      // the "is poison" operand of these works like a flag
+      if ((ID == Intrinsic::ctlz || ID == Intrinsic::cttz ||
+           ID == Intrinsic::abs) &&
+          cast<ConstantInt>(II->getArgOperand(1))->isOne())
+        Flag(Intrinsic::getBaseName(ID).str() + " poison");
+    }
+    if (auto *Call = dyn_cast<CallInst>(&I)) {
+      auto *Callee = Call->getCalledFunction();
+      summarizeAttrs(S, Call->getAttributes(),
+                     (Callee ? Callee->getName().str() : Op) + " ");
+    }
+  }
+  llvm::sort(S.Marks);
+  return S;
+}
+
+// whether X is allowed to replace S
+bool refines(const Outcome &S, const Outcome &X) {
+  if (S.K == Outcome::UB)
+    return true;
+  if (S.K == Outcome::POISON)
+    return X.K != Outcome::UB;
+  return X == S;
+}
+
+/*
+ * run the source and both optimized versions on the same inputs:
+ * every input if there are at most --compare-inputs of them, and
+ * otherwise that many pseudorandom ones, a quarter of the arguments
+ * being edge values. the result is "wrong-a", "wrong-b", or
+ * "wrong-both" if a pipeline doesn't refine the source, "differ" if
+ * both do but not in the same way (one leaves more poison or UB, say),
+ * "same", or "unknown" if the interpreter can't run them. Input says
+ * where the first reported difference was seen
+ */
+std::string compareBehavior(Function &Src, Function &A, Function &B,
+                            std::string &Input) {
+  if (A.getFunctionType() != Src.getFunctionType() ||
+      B.getFunctionType() != Src.getFunctionType())
+    return "unknown";
+  unsigned Bits = 0;
+  for (auto &Arg : Src.args())
+    Bits += Arg.getType()->getIntegerBitWidth();
+  bool Exhaustive = Bits < 32 && (1ULL << Bits) <= CompareInputs;
+  uint64_t NumInputs = Exhaustive ? 1ULL << Bits : (uint64_t)CompareInputs;
+  // SeededHash, like every other choice, depends only on Choices and
+  // --seed, so the inputs in the CSV can be reproduced anywhere
+  std::mt19937_64 Rng(SeededHash);
+
+  Evaluator ES(Src), EA(A), EB(B);
+  bool Ran = false, WrongA = false, WrongB = false, Differ = false;
+  std::vector<APInt> Args;
+  for (uint64_t n = 0; n < NumInputs && !(WrongA && WrongB); ++n) {
+    Args.clear();
+    uint64_t Rest = n;
+    for (auto &Arg : Src.args()) {
+      unsigned Width = Arg.getType()->getIntegerBitWidth();
+      if (Exhaustive) {
+        Args.push_back(APInt(Width, Rest & ((1ULL << Width) - 1)));
+        Rest >>= Width;
+        continue;
+      }
+      uint64_t R = Rng();
+      if ((R & 3) == 0) {
+        const APInt Edges[] = {APInt(Width, 0), APInt(Width, 1),
+                               APInt::getAllOnes(Width),
+                               APInt::getSignedMinValue(Width),
+                               APInt::getSignedMaxValue(Width)};
+        Args.push_back(Edges[(R >> 2) % 5]);
+      } else {
+        uint64_t Words[] = {Rng(), Rng()};
+        Args.push_back(APInt(Width, Words));
+      }
+    }
+
+    Outcome OS = ES.run(Args), OA = EA.run(Args), OB = EB.run(Args);
+    for (auto *O : {&OS, &OA, &OB})
+      if (O->K == Outcome::UNSUPPORTED)
+        return "unknown";
+    if (OS.K == Outcome::NONDET || OA.K == Outcome::NONDET ||
+        OB.K == Outcome::NONDET)
+      continue;
+    Ran = true;
+    bool WA = !refines(OS, OA), WB = !refines(OS, OB);
+    bool First = (WA && !WrongA) || (WB && !WrongB) ||
+                 (!WrongA && !WrongB && !Differ && !(OA == OB));
+    WrongA |= WA;
+    WrongB |= WB;
+    Differ |= !(OA == OB);
+    if (First) {
+      Input.clear();
+      for (auto &Arg : Src.args()) {
+        Input += Input.empty() ? "%" : " %";
+        Input += Arg.hasName() ? Arg.getName().str()
+                               : std::to_string(Arg.getArgNo());
+        Input += "=" + toString(Args[Arg.getArgNo()], 10, /*Signed=*/true);
+      }
+    }
+  }
+  if (WrongA || WrongB)
+    return WrongA && WrongB ? "wrong-both" : WrongA ? "wrong-a" : "wrong-b";
+  if (Differ)
+    return "differ";
+  return Ran ? "same" : "unknown";
+}
+
+/*
+ * functions on which the pipelines disagree are written out as
+ * NAME.ll, NAME.opt.ll (--passes), and NAME.opt2.ll (--compare-passes)
+ * with a line in the --compare-csv file. the texts come in with the
+ * function still called BaseName
+ */
+void compare(std::string Src, Module &SrcMod, std::string Tgt, Module &AMod,
+             std::string Tgt2, Module &BMod, const std::string &Tag,
+             const std::string &Note) {
+  Function *FS = SrcMod.getFunction(BaseName), *FA = AMod.getFunction(BaseName),
+           *FB = BMod.getFunction(BaseName);
+  if (!FS || !FA || !FB)
+    die("a pipeline removed the function");
+  Summary SA = summarize(*FA), SB = summarize(*FB);
+  std::string Input,
+      Behavior = CompareInputs ? compareBehavior(*FS, *FA, *FB, Input)
+                               : "unknown";
+  bool DiffInsns = SA.Insns != SB.Insns;
+  bool DiffFlags = SA.Marks != SB.Marks;
+  bool DiffBehavior = Behavior != "same" && Behavior != "unknown";
+
+  std::string Name = BaseName + std::to_string(Id) + Tag;
+  std::string Line = Name + "," + std::to_string(SA.Insns) + "," +
+                     std::to_string(SB.Insns) + "," +
+                     std::to_string(SA.Flags) + "," +
+                     std::to_string(SB.Flags) + "," +
+                     std::to_string(SA.Attrs) + "," +
+                     std::to_string(SB.Attrs) + "," + Behavior + "," + Input +
+                     "\n";
+  if (Replaying) {
+    addProvenance(Src, Note);
+    outs() << Src << Tgt << Tgt2;
+    errs() << Line;
+    return;
+  }
+
+  Shmem->NumCompared++;
+  Shmem->NumDiffInsns += DiffInsns;
+  Shmem->NumDiffFlags += DiffFlags;
+  Shmem->NumDiffBehavior += DiffBehavior;
+  Shmem->NumWrong += Behavior.compare(0, 5, "wrong") == 0;
+  if (!DiffInsns && !DiffFlags && !DiffBehavior)
+    return;
+
+  renameFunc(Src, OneFuncPerFile ? std::string("f") : Name);
+  renameFunc(Tgt, OneFuncPerFile ? std::string("f") : Name);
+  renameFunc(Tgt2, OneFuncPerFile ? std::string("f") : Name);
+  addProvenance(Src, Note);
+  writeFile(OutDir + Name + ".ll", Src);
+  writeFile(OutDir + Name + ".opt.ll", Tgt);
+  writeFile(OutDir + Name + ".opt2.ll", Tgt2);
+
+  // like emit(), count on a short O_APPEND write being atomic
+  std::string FN = OutDir + CompareCSV;
+  int fd = open(FN.c_str(), O_WRONLY | O_CREAT | O_APPEND, S_IREAD | S_IWRITE);
+  if (fd < 2)
+    die("open failed");
+  if (write(fd, Line.c_str(), Line.length()) != (ssize_t)Line.length())
+    die("non-atomic write");
+  int res = close(fd);
+  assert(res == 0);
+}
+
+/*
+ * --time-compile: each function goes through the pipeline, and with
+ * --time-codegen through code generation, with every pass timed. the
+ * times go into log-scale histograms in shared memory, one per pass,
+ * and a function that is slower than the --slow-percentile of a
+ * histogram, or than --slow-micros, is timed twice more in case it
+ * was just preempted. it is written out if its best time is still slow
+ */
+#define SLOW_WARMUP 1000
+// nanoseconds; percentiles of passes that take less aren't worth reporting
+#define SLOW_FLOOR 10000
+
+// code generators for each target triple, made by setupCodegen()
+std::map<std::string, TargetMachine *> Machines;
+StringMap<int> HistIndex;
+
+int histogram(StringRef Name) {
+  auto It = HistIndex.find(Name);
+  if (It != HistIndex.end())
+    return It->second;
+  std::string N = Name.substr(0, sizeof(Shmem->Hist[0].Name) - 1).str();
+  int H = -1;
+  if (pthread_mutex_lock(&Shmem->Lock) != 0)
+    die("lock failed");
+  for (int i = 0; i < MAX_TIMED; ++i) {
+    char *Slot = Shmem->Hist[i].Name;
+    if (Slot[0] == 0)
+      strcpy(Slot, N.c_str());
+    if (N == Slot) {
+      H = i;
+      break;
+    }
+  }
+  if (pthread_mutex_unlock(&Shmem->Lock) != 0)
+    die("unlock failed");
+  // with the table full, further passes just aren't timed
+  HistIndex[Name] = H;
+  return H;
+}
+
+long bucketStart(int B) {
+  if (B < HIST_SUB)
+    return B;
+  // bucketOf() never returns HIST_SUB .. 2 * HIST_SUB - 1, which are
+  // empty, so they start where the next bucket does
+  if (B < 2 * HIST_SUB)
+    return HIST_SUB;
+  // and the last few would start at 2^63
+  if (B >= 63 * HIST_SUB)
+    return LONG_MAX;
+  return (long)(HIST_SUB + B % HIST_SUB) << (B / HIST_SUB - 2);
+}
+
+int bucketOf(long Ns) {
+  if (Ns < HIST_SUB)
+    return std::max(Ns, 0L);
+  int L = Log2_64(Ns);
+  int B = L * HIST_SUB + ((Ns >> (L - 2)) & (HIST_SUB - 1));
+  assert(bucketStart(B) <= Ns);
+  return B;
+}
+
+// the bucket holding the P-th percentile of histogram H
+int percentileBucket(int H, double P) {
+  auto &Hist = Shmem->Hist[H];
+  long Need = std::ceil(Hist.Count * P / 100), Sum = 0;
+  for (int b = 0; b < HIST_BUCKETS; ++b) {
+    Sum += Hist.Buckets[b];
+    if (Sum >= std::max(Need, 1L))
+      return b;
+  }
+  return HIST_BUCKETS - 1;
+}
+
+std::string micros(long Ns) {
+  std::string S;
+  raw_string_ostream(S) << format("%.1f", Ns / 1000.0);
+  return S;
+}
+
+// why taking Ns nanoseconds is slow for histogram H, or "" if it isn't
+std::string slowness(int H, long Ns) {
+  if (SlowMicros && Ns > (long)SlowMicros * 1000)
+    return "more than --slow-micros";
+  if (SlowPercentile <= 0 || Shmem->Hist[H].Count < SLOW_WARMUP ||
+      Ns < SLOW_FLOOR)
+    return "";
+  int B = percentileBucket(H, SlowPercentile);
+  if (bucketOf(Ns) <= B)
+    return "";
+  std::string S;
+  raw_string_ostream(S) << "p" << format("%g", SlowPercentile.getValue())
+                        << " is under " << micros(bucketStart(B + 1)) << " us";
+  return S;
+}
+
+long nanosSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - Start)
+      .count();
+}
+
+long timeCodegen(Module &Mod, const std::string &Triple) {
+  TargetMachine *TM = Machines.at(Triple);
+  Mod.setTargetTriple(Triple);
+  Mod.setDataLayout(TM->createDataLayout());
+  SmallVector<char, 0> Obj;
+  raw_svector_ostream OS(Obj);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile))
+    die("can't generate code");
+  auto Start = std::chrono::steady_clock::now();
+  PM.run(Mod);
+  return nanosSince(Start);
+}
+
+// nanoseconds taken by the whole pipeline, each pass, and codegen
+StringMap<long> timeOnce(Module &Src) {
+  StringMap<long> T;
+  auto Mod = CloneModule(Src);
+  if (Opt) {
+    Opt->run(*Mod);
+    T["pipeline"] = Opt->RunTime;
+    for (auto &P : Opt->PassTimes)
+      T[P.getKey()] = P.getValue();
+  }
+  if (TimeCodegen) {
+    std::string Triple = Mod->getTargetTriple();
+    if (Triple.empty())
+      Triple = sys::getDefaultTargetTriple();
+    T["codegen " + Triple] = timeCodegen(*Mod, Triple);
+  }
+  return T;
+}
+
+void timeCompile(std::string Src, Module *Mod, const std::string &Tag,
+                 const std::string &Note) {
+  std::unique_ptr<Module> Parsed;
+  if (!Mod) {
+    SMDiagnostic Err;
+    Parsed = parseAssemblyString(Src, Err, C);
+    if (!Parsed)
+      die("can't parse a generated function");
+    Mod = Parsed.get();
+  }
+  /*
+   * every process times just one function, so the first run would
+   * mostly time lazy setup, like the target's subtarget and MC layers
+   * and copy-on-write faults; it isn't counted
+   */
+  timeOnce(*Mod);
+  StringMap<long> T = timeOnce(*Mod);
+  if (Replaying) {
+    addProvenance(Src, Note);
+    outs() << Src;
+    for (auto &X : T)
+      errs() << X.getKey() << ": " << micros(X.getValue()) << " us\n";
+    return;
+  }
+
+  Shmem->NumTimed++;
+  bool Slow = false;
+  for (auto &X : T) {
+    int H = histogram(X.getKey());
+    if (H == -1)
+      continue;
+    auto &Hist = Shmem->Hist[H];
+    Hist.Buckets[bucketOf(X.getValue())]++;
+    Hist.Count++;
+    long Max = Hist.Max;
+    while (X.getValue() > Max &&
+           !Hist.Max.compare_exchange_weak(Max, X.getValue()))
+      ;
+    Slow |= !slowness(H, X.getValue()).empty();
+  }
+  if (!Slow)
+    return;
+
+  for (int i = 0; i < 2; ++i)
+    for (auto &X : timeOnce(*Mod)) {
+      auto It = T.find(X.getKey());
+      if (It != T.end())
+        It->second = std::min(It->second, X.getValue());
+    }
+  std::string Why;
+  for (auto &X : T) {
+    int H = histogram(X.getKey());
+    std::string S = H == -1 ? "" : slowness(H, X.getValue());
+    if (S.empty())
+      continue;
+    Shmem->Hist[H].NumSlow++;
+    Why += "; opt-fuzz slow: " + X.getKey().str() + " took " +
+           micros(X.getValue()) + " us, " + S + "\n";
+  }
+  if (Why.empty())
+    return;
+  Shmem->NumSlow++;
+  std::string Name = BaseName + std::to_string(Id) + Tag;
+  renameFunc(Src, OneFuncPerFile ? std::string("f") : Name);
+  addProvenance(Src, Note + Why);
+  writeFile(OutDir + Name + ".ll", Src);
+}
+
+// set when a --reduce candidate is being emitted
+std::string ReduceFile;
+// the files, after ReduceFile, that the oracle may be handed: the
+// function, then its --passes and --compare-passes optimizations
+const char *const ReduceSuffixes[] = {".ll", ".opt.ll", ".opt2.ll"};
+bool Interesting = false;
+
+/*
+ * emit one function, whose text still calls it BaseName; Tag tells
+ * apart several functions coming from the same leaf and Note is added
+ * to its provenance. Mod is the function's module if we have one,
+ * otherwise Src gets parsed when there's optimizing to do
+ */
+void emit(std::string Src, Module *Mod, const std::string &Tag,
+          const std::string &Note = "") {
+  if (TimeCompile && ReduceFile.empty()) {
+    timeCompile(Src, Mod, Tag, Note);
+    return;
+  }
+
+  std::string Tgt, Tgt2;
+  std::unique_ptr<Module> Orig, Mod2;
+  if (Opt) {
+    std::unique_ptr<Module> Parsed;
+    if (!Mod) {
+      SMDiagnostic Err;
+      Parsed = parseAssemblyString(Src, Err, C);
+      if (!Parsed)
+        die("can't parse a generated function");
+      Mod = Parsed.get();
+    }
+    if (Opt2) {
+      Orig = CloneModule(*Mod);
+      Mod2 = CloneModule(*Mod);
+    }
+    bool Record = CoverageGuided && !Replaying && ReduceFile.empty();
+    std::multiset<std::string> Before;
+    if (Record) {
+      Before = instKinds(*Mod);
+      ResetStatistics();
+    }
+    Opt->run(*Mod);
+    if (Record)
+      recordCoverage(Before, *Mod);
+    Tgt = printModule(*Mod);
+    if (Opt2) {
+      Opt2->run(*Mod2);
+      Tgt2 = printModule(*Mod2);
+    }
+  }
+
+  if (!ReduceFile.empty()) {
+    addProvenance(Src, Note);
+    const std::string *Texts[] = {&Src, &Tgt, &Tgt2};
+    std::string Cmd = Oracle;
+    for (unsigned i = 0; i < std::size(ReduceSuffixes); ++i) {
+      if (Texts[i]->empty())
+        continue;
+      writeFile(ReduceFile + ReduceSuffixes[i], *Texts[i]);
+      Cmd += " " + ReduceFile + ReduceSuffixes[i];
+    }
+    Interesting = ::system(Cmd.c_str()) == 0;
+    return;
+  }
+
+  if (Opt2) {
+    compare(Src, *Orig, Tgt, *Mod, Tgt2, *Mod2, Tag, Note);
+    return;
+  }
+
+  if (Replaying) {
+    addProvenance(Src, Note);
+    outs() << Src << Tgt;
+    return;
+  }
+
+  if (useVerifier()) {
+    check(Src, Tgt, Tag, Note);
+    return;
+  }
+
+  std::string Name = BaseName + std::to_string(Id) + Tag;
+  renameFunc(Src, OneFuncPerFile ? std::string("f") : Name);
+  addProvenance(Src, Note);
 
   int fd;
   if (OneFuncPerFile) {
-    std::stringstream ss;
-    ss << BaseName << std::to_string(Id);
-    func.replace(func.find(BaseName), BaseName.length(), "f");
-    std::string FN = BaseName + std::to_string(Id) + ".ll";
+    std::string FN = OutDir + Name + ".ll";
     fd = open(FN.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IREAD | S_IWRITE);
   } else {
-    std::stringstream ss;
-    ss << BaseName << std::to_string(Id);
-    func.replace(func.find(BaseName), BaseName.length(), ss.str());
-    std::string FN = std::to_string(rand() % NumFiles) + ".ll";
+    std::string FN = OutDir + std::to_string(rand() % NumFiles) + ".ll";
     fd = open(FN.c_str(), O_RDWR | O_CREAT | O_APPEND, S_IREAD | S_IWRITE);
   }
   if (fd < 2)
@@ -970,13 +3450,694 @@ void output() {
    * an atomic write and bail if it doesn't work -- this seems to work
    * fine on Linux and OS X
    */
-  unsigned res = write(fd, func.c_str(), func.length());
-  if (res != func.length())
+  unsigned res = write(fd, Src.c_str(), Src.length());
+  if (res != Src.length())
     die("non-atomic write");
   res = close(fd);
   assert(res == 0);
 }
 
+/*
+ * bulk instantiation of symbolic constants: the function is printed
+ * once and cut into pieces around its uses of %c0, %c1, ... so that
+ * stamping out a tuple of constants is just a concatenation
+ */
+std::vector<APInt> ConstSet;
+std::vector<std::vector<APInt>> ConstTupleList;
+
+bool instantiating() { return !ConstSet.empty() || !ConstTupleList.empty(); }
+
+APInt parseConst(StringRef S) {
+  bool Neg = S.consume_front("-");
+  APInt V;
+  if (S.getAsInteger(0, V))
+    die(("can't parse constant '" + S.str() + "'").c_str());
+  V = V.zextOrTrunc(W);
+  return Neg ? -V : V;
+}
+
+std::vector<std::vector<APInt>> readConstFile(const std::string &FN) {
+  auto Buf = MemoryBuffer::getFile(FN);
+  if (!Buf)
+    die(("can't read " + FN).c_str());
+  std::vector<std::vector<APInt>> Lines;
+  SmallVector<StringRef, 16> Ls, Vs;
+  (*Buf)->getBuffer().split(Ls, '\n');
+  for (auto L : Ls) {
+    L = L.split('#').first.trim();
+    if (L.empty())
+      continue;
+    Vs.clear();
+    L.split(Vs, ' ', -1, /*KeepEmpty=*/false);
+    std::vector<APInt> Tuple;
+    for (auto V : Vs)
+      Tuple.push_back(parseConst(V.trim()));
+    Lines.push_back(Tuple);
+  }
+  return Lines;
+}
+
+void setupConsts() {
+  for (auto &Name : ConstValues) {
+    if (Name == "edge") {
+      ConstSet.push_back(APInt(W, 0));
+      ConstSet.push_back(APInt(W, 1));
+      ConstSet.push_back(APInt(W, 2));
+      ConstSet.push_back(APInt::getAllOnes(W));
+      ConstSet.push_back(APInt::getSignedMinValue(W));
+      ConstSet.push_back(APInt::getSignedMaxValue(W));
+    } else if (Name == "pow2") {
+      for (int i = 0; i < W; ++i)
+        ConstSet.push_back(APInt::getOneBitSet(W, i));
+    } else if (Name == "mask") {
+      for (int i = 1; i < W; ++i) {
+        ConstSet.push_back(APInt::getLowBitsSet(W, i));
+        ConstSet.push_back(APInt::getHighBitsSet(W, i));
+      }
+    } else {
+      for (auto &Line : readConstFile(Name))
+        ConstSet.insert(ConstSet.end(), Line.begin(), Line.end());
+    }
+  }
+  std::sort(ConstSet.begin(), ConstSet.end(),
+            [](const APInt &A, const APInt &B) { return A.slt(B); });
+  ConstSet.erase(std::unique(ConstSet.begin(), ConstSet.end()),
+                 ConstSet.end());
+  if (!ConstTuples.empty())
+    ConstTupleList = readConstFile(ConstTuples);
+  if (instantiating() && !SymbolicConsts)
+    die("--const-values and --const-tuples need --symbolic-consts");
+  if (instantiating() && skeletons())
+    die("--const-values and --const-tuples don't work with --widths");
+}
+
+std::string constText(const APInt &V) {
+  SmallString<16> S;
+  V.toString(S, 10, /*Signed=*/true);
+  return std::string(S.str());
+}
+
+/*
+ * the printed function is cut once, at every use of a constant
+ * parameter, into pieces with holes numbered by parameter. stamping
+ * out a tuple is then just concatenation, where going back to the
+ * module would cost a print per tuple
+ */
+void instantiateConsts(const std::string &Text, Module &Mod) {
+  unsigned K = ConstArgs.size();
+  if (K == 0) {
+    emit(Text, &Mod, "");
+    return;
+  }
+
+  // the constants are the last parameters, drop them from the signature
+  size_t Open = Text.find('(', Text.find("define "));
+  size_t Close = Text.find(')', Open);
+  size_t First = Text.find(" %c0", Open);
+  assert(First < Close);
+  size_t Cut = Text.rfind(", ", First);
+  if (Cut == std::string::npos || Cut < Open)
+    Cut = Open + 1;
+
+  std::vector<std::string> Pieces{Text.substr(0, Cut)};
+  std::vector<unsigned> Slots;
+  size_t Pos = Close;
+  while (true) {
+    size_t Next = Text.find("%c", Pos);
+    if (Next == std::string::npos)
+      break;
+    size_t End = Next + 2;
+    while (End < Text.length() && isDigit(Text[End]))
+      ++End;
+    if (End == Next + 2 ||
+        (End < Text.length() && (isAlnum(Text[End]) || Text[End] == '.' ||
+                                 Text[End] == '_'))) {
+      Pieces.back() += Text.substr(Pos, End - Pos);
+      Pos = End;
+      continue;
+    }
+    Pieces.back() += Text.substr(Pos, Next - Pos);
+    Slots.push_back(std::stoi(Text.substr(Next + 2, End - Next - 2)));
+    assert(Slots.back() < K);
+    Pieces.push_back("");
+    Pos = End;
+  }
+  Pieces.back() += Text.substr(Pos);
+
+  long Count = 0;
+  auto Stamp = [&](const std::vector<APInt> &Tuple) {
+    std::vector<std::string> Vals;
+    std::string Note = "; opt-fuzz consts:";
+    for (auto &V : Tuple) {
+      Vals.push_back(constText(V));
+      Note += " " + Vals.back();
+    }
+    std::string Out = Pieces[0];
+    for (unsigned i = 0; i < Slots.size(); ++i) {
+      Out += Vals[Slots[i]];
+      Out += Pieces[i + 1];
+    }
+    emit(Out, nullptr, "_" + std::to_string(Count++), Note + "\n");
+  };
+
+  for (auto &Tuple : ConstTupleList)
+    if (Tuple.size() == K)
+      Stamp(Tuple);
+
+  if (ConstSet.empty() || MaxConstTuples <= 0)
+    return;
+
+  /*
+   * tuple number I has, as its digits in base N, the indices of its
+   * values. when there are more tuples than --max-const-tuples, walk
+   * them with a stride instead of stopping early, which would leave
+   * the last constants stuck at the first few values. a stride prime
+   * to N keeps c0 turning over too
+   */
+  uint64_t N = ConstSet.size();
+  unsigned Bits = K * (Log2_64_Ceil(N) + 1) + 64;
+  APInt Total = APInt(Bits, 1), Base(Bits, N);
+  for (unsigned i = 0; i < K; ++i)
+    Total *= Base;
+  APInt Cap(Bits, MaxConstTuples), Step(Bits, 1);
+  if (Total.ugt(Cap)) {
+    Step = (Total + Cap - 1).udiv(Cap);
+    while (GreatestCommonDivisor64(Step.urem(N), N) != 1)
+      ++Step;
+  }
+  std::vector<APInt> Tuple(K, ConstSet[0]);
+  for (APInt I(Bits, 0); I.ult(Total); I += Step) {
+    APInt Rest = I;
+    for (unsigned i = 0; i < K; ++i) {
+      uint64_t Digit;
+      APInt::udivrem(Rest, N, Rest, Digit);
+      Tuple[i] = ConstSet[Digit];
+    }
+    Stamp(Tuple);
+  }
+}
+
+/*
+ * --targets: a function is generated once, for no target and without
+ * promotion, and then specialized for each target on the way out
+ */
+struct TargetInfo {
+  const char *Name, *Triple, *DataLayout;
+  // arguments and return values narrower than this are widened
+  int Promote;
+};
+
+const TargetInfo KnownTargets[] = {
+    {"x86_64", "x86_64-unknown-linux-gnu",
+     "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128",
+     32},
+    {"aarch64", "aarch64-unknown-linux-gnu",
+     "e-m:e-i8:8:32-i16:16:32-i64:64-i128:128-n32:64-S128", 32},
+    {"riscv64", "riscv64-unknown-linux-gnu",
+     "e-m:e-p:64:64-i64:64-i128:128-n64-S128", 64},
+    {"i686", "i686-unknown-linux-gnu",
+     "e-m:e-p:32:32-p270:32:32-p271:32:32-p272:64:64-f64:32:64-f80:32-n8:16:"
+     "32-S128",
+     32},
+    {"riscv32", "riscv32-unknown-linux-gnu", "e-m:e-p:32:32-i64:64-n32-S128",
+     32},
+};
+
+std::vector<TargetInfo> OutTargets;
+
+void setupTargets() {
+  if (ARM64) {
+    if (!Targets.empty())
+      die("--arm64 and --targets are mutually exclusive");
+    OutTargets.push_back(KnownTargets[1]);
+    OutTargets.back().Promote = Promote;
+  }
+  for (auto &Name : Targets) {
+    auto *T = std::find_if(std::begin(KnownTargets), std::end(KnownTargets),
+                           [&](const TargetInfo &T) { return Name == T.Name; });
+    if (T == std::end(KnownTargets))
+      die(("unknown target '" + Name + "'").c_str());
+    OutTargets.push_back(*T);
+    // an explicit --promote wins over the calling convention
+    if (Promote != -1)
+      OutTargets.back().Promote = Promote;
+  }
+  if (OutTargets.empty())
+    return;
+  // promotion now happens per target, in promoteModule()
+  Promote = -1;
+  if (OutTargets.size() > 1) {
+    if (!Reduce.empty())
+      die("--reduce works with a single target");
+    for (auto &T : OutTargets)
+      if (sys::fs::create_directories(T.Name))
+        die("can't create a target directory");
+  }
+}
+
+// --time-codegen generates code for every target functions are made for
+void setupCodegen() {
+#define INIT_TARGET(T)                                                         \
+  LLVMInitialize##T##TargetInfo();                                             \
+  LLVMInitialize##T##Target();                                                 \
+  LLVMInitialize##T##TargetMC();                                               \
+  LLVMInitialize##T##AsmPrinter();
+#ifdef OPTFUZZ_TARGET_X86
+  INIT_TARGET(X86)
+#endif
+#ifdef OPTFUZZ_TARGET_AArch64
+  INIT_TARGET(AArch64)
+#endif
+#ifdef OPTFUZZ_TARGET_RISCV
+  INIT_TARGET(RISCV)
+#endif
+#undef INIT_TARGET
+  std::vector<std::string> Triples;
+  for (auto &T : OutTargets)
+    Triples.push_back(T.Triple);
+  if (Triples.empty())
+    Triples.push_back(sys::getDefaultTargetTriple());
+  for (auto &Triple : Triples) {
+    std::string Err;
+    const Target *T = TargetRegistry::lookupTarget(Triple, Err);
+    if (!T)
+      die(("can't generate code for " + Triple + ": " + Err).c_str());
+    Machines[Triple] =
+        T->createTargetMachine(Triple, "", "", TargetOptions(), None);
+  }
+}
+
+/*
+ * widen the parameters and the return value the way generate() does
+ * for --promote: a promoted input is truncated at the top of the entry
+ * block, a promoted return value is zero extended. the last NumConsts
+ * parameters are symbolic constants, which keep their width
+ */
+void promoteModule(Module &Mod, int P, unsigned NumConsts) {
+  if (P == -1)
+    return;
+  auto Widen = [&](Type *T) -> Type * {
+    if (T->getIntegerBitWidth() < (unsigned)P)
+      return IntegerType::getIntNTy(C, P);
+    return T;
+  };
+  Function *Old = nullptr;
+  for (auto &Fn : Mod)
+    if (!Fn.isDeclaration())
+      Old = &Fn;
+  assert(Old);
+
+  std::vector<Type *> ParamsTy;
+  unsigned NumInputs = Old->arg_size() - NumConsts;
+  for (auto &A : Old->args())
+    ParamsTy.push_back(A.getArgNo() < NumInputs ? Widen(A.getType())
+                                                : A.getType());
+  Type *RetTy = Widen(Old->getReturnType());
+  auto *Real = Function::Create(FunctionType::get(RetTy, ParamsTy, false),
+                                GlobalValue::ExternalLinkage, "");
+  Mod.getFunctionList().insert(Old->getIterator(), Real);
+  Real->takeName(Old);
+  Real->getBasicBlockList().splice(Real->end(), Old->getBasicBlockList());
+
+  IRBuilder<NoFolder> B(&Real->getEntryBlock(),
+                        Real->getEntryBlock().begin());
+  for (unsigned n = 0; n < ParamsTy.size(); ++n) {
+    Argument *From = Old->getArg(n), *To = Real->getArg(n);
+    To->takeName(From);
+    Value *V = To;
+    if (To->getType() != From->getType() && !From->use_empty())
+      V = B.CreateTrunc(To, From->getType());
+    From->replaceAllUsesWith(V);
+  }
+  if (Old == F)
+    F = Real;
+  Old->eraseFromParent();
+
+  // --args-from-memory inputs are loads from globals instead
+  std::vector<LoadInst *> Loads;
+  for (auto &I : Real->getEntryBlock())
+    if (auto *L = dyn_cast<LoadInst>(&I))
+      if (isa<GlobalVariable>(L->getPointerOperand()))
+        Loads.push_back(L);
+  for (auto *L : Loads) {
+    Type *T = Widen(L->getType());
+    if (T == L->getType())
+      continue;
+    auto *G = cast<GlobalVariable>(L->getPointerOperand());
+    auto *NewG = new GlobalVariable(Mod, T, /*isConstant=*/false,
+                                    /*Linkage=*/GlobalValue::ExternalLinkage,
+                                    /*Initializer=*/0, "", G);
+    B.SetInsertPoint(L);
+    Value *V = B.CreateLoad(T, NewG);
+    if (!L->use_empty())
+      V = B.CreateTrunc(V, L->getType());
+    L->replaceAllUsesWith(V);
+    L->eraseFromParent();
+    G->eraseFromParent();
+  }
+
+  for (auto &BB : *Real) {
+    auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+    if (!Ret || Ret->getReturnValue()->getType() == RetTy)
+      continue;
+    B.SetInsertPoint(Ret);
+    Ret->setOperand(0, B.CreateZExt(Ret->getReturnValue(), RetTy));
+  }
+}
+
+void retarget(Module &Mod, const TargetInfo &T) {
+  Mod.setTargetTriple(T.Triple);
+  Mod.setDataLayout(T.DataLayout);
+  const DataLayout &DL = Mod.getDataLayout();
+  promoteModule(Mod, T.Promote, ConstArgs.size());
+  for (auto &Fn : Mod)
+    for (auto &I : instructions(Fn))
+      if (auto *L = dyn_cast<LoadInst>(&I))
+        L->setAlignment(DL.getABITypeAlign(L->getType()));
+}
+
+std::string OutBuf;
+
+void outputModule(Module &Mod) {
+  printModule(Mod, OutBuf);
+
+  if (instantiating())
+    instantiateConsts(OutBuf, Mod);
+  else
+    emit(OutBuf, &Mod, "");
+}
+
+void output() {
+  if (Verify || (VerifyEvery > 0 && Id % VerifyEvery == 0))
+    if (verifyModule(*M, &errs()))
+      report_fatal_error("Broken module found, compilation aborted!");
+  if (OutTargets.empty()) {
+    outputModule(*M);
+    return;
+  }
+
+  // M itself is used for the last target, after it has been cloned
+  for (unsigned t = 0; t < OutTargets.size(); ++t) {
+    std::unique_ptr<Module> Clone;
+    Module *Mod = M;
+    if (t + 1 < OutTargets.size()) {
+      Clone = CloneModule(*M);
+      Mod = Clone.get();
+    }
+    retarget(*Mod, OutTargets[t]);
+    if (OutTargets.size() > 1) {
+      OutDir = std::string(OutTargets[t].Name) + "/";
+      // every target sees the same random numbers
+      reseed();
+    }
+    outputModule(*Mod);
+  }
+}
+
+std::vector<int> parseChoices(StringRef S) {
+  SmallVector<StringRef, 32> Parts;
+  S.split(Parts, ' ', -1, /*KeepEmpty=*/false);
+  std::vector<int> Res;
+  for (auto P : Parts) {
+    int i;
+    if (P.getAsInteger(10, i))
+      die("a choice string is a list of numbers");
+    Res.push_back(i);
+  }
+  return Res;
+}
+
+void resetGenerator() {
+  delete Builder;
+  Builder = nullptr;
+  delete M;
+  M = nullptr;
+  F = nullptr;
+  Vals.clear();
+  ArgWidths.clear();
+  Args.clear();
+  BBs.clear();
+  ConstArgs.clear();
+  PendingSlots = 0;
+  WidthNeeds = 0;
+}
+
+/*
+ * --widths: the function generate() just built is a skeleton, at the
+ * largest width; one width it is legal at is chosen, and the skeleton
+ * is built again at that width by replaying its choices
+ */
+void chooseWidth() {
+  if (!skeletons())
+    return;
+  std::vector<int> Legal;
+  for (int Width : Widths)
+    if (widthOK(Width))
+      Legal.push_back(Width);
+  if (Legal.empty())
+    prune();
+  std::string Skeleton = Choices;
+  int Width = Legal.size() > 1 ? Legal[Choose(Legal.size())] : Legal[0];
+  if (Width == W)
+    return;
+
+  std::string Full = Choices;
+  auto OldChoices = ReplayChoices;
+  unsigned OldPos = ReplayPos;
+  bool OldReplaying = Replaying, OldLenient = LenientReplay;
+  ReplayChoices = parseChoices(Skeleton);
+  ReplayPos = 0;
+  Replaying = true;
+  LenientReplay = false;
+  setChoices("");
+  resetGenerator();
+  W = Width;
+  generate();
+  ReplayChoices = OldChoices;
+  ReplayPos = OldPos;
+  Replaying = OldReplaying;
+  LenientReplay = OldLenient;
+  setChoices(Full);
+}
+
+/*
+ * test-case reduction in the space of choice strings: every candidate
+ * is replayed leniently (choices are clamped to range, and missing
+ * ones are 0, which is generally the simplest option) so it always
+ * yields valid IR, and since the effective choices are recorded each
+ * candidate is reported back in canonical form. smaller means fewer
+ * instructions, then a shorter choice string, then smaller choices
+ */
+struct Candidate {
+  std::vector<int> Choices;
+  bool Interesting = false;
+  long Insns = 0;
+
+  bool operator<(const Candidate &O) const {
+    if (Insns != O.Insns)
+      return Insns < O.Insns;
+    if (Choices.size() != O.Choices.size())
+      return Choices.size() < O.Choices.size();
+    long Sum = 0, OSum = 0;
+    for (int c : Choices)
+      Sum += c;
+    for (int c : O.Choices)
+      OSum += c;
+    return Sum < OSum;
+  }
+};
+
+// the child replays a candidate, runs the oracle, and reports
+// "<interesting> <instructions> <choices>" on its pipe
+void tryCandidate(const std::vector<int> &Cand, int fd) {
+  Replaying = LenientReplay = true;
+  ReplayChoices = Cand;
+  setChoices("");
+  ReduceFile = "reduce-" + std::to_string(::getpid());
+  generate();
+  chooseWidth();
+  long Insns = 0;
+  for (auto &I : instructions(F))
+    Insns += !I.isTerminator();
+  output();
+  std::string Res = std::to_string(Interesting) + " " + std::to_string(Insns) +
+                    " " + Choices + "\n";
+  writeAll(fd, Res.c_str(), Res.length());
+  for (const char *Suffix : ReduceSuffixes)
+    ::remove((ReduceFile + Suffix).c_str());
+}
+
+std::vector<Candidate> tryCandidates(const std::vector<std::vector<int>> &Cands) {
+  std::vector<Candidate> Results(Cands.size());
+  for (unsigned Base = 0; Base < Cands.size(); Base += Cores) {
+    std::vector<std::pair<pid_t, int>> Kids;
+    for (unsigned i = Base; i < Cands.size() && i < Base + Cores; ++i) {
+      int P[2];
+      if (::pipe(P) != 0)
+        die("pipe failed");
+      pid_t pid = ::fork();
+      if (pid == -1)
+        die("fork failed");
+      if (pid == 0) {
+        ::close(P[0]);
+        tryCandidate(Cands[i], P[1]);
+        ::_exit(0);
+      }
+      ::close(P[1]);
+      Kids.push_back({pid, P[0]});
+    }
+    for (unsigned k = 0; k < Kids.size(); ++k) {
+      std::string Out;
+      char Buf[4096];
+      ssize_t n;
+      while ((n = read(Kids[k].second, Buf, sizeof(Buf))) > 0)
+        Out.append(Buf, n);
+      ::close(Kids[k].second);
+      waitpid(Kids[k].first, 0, 0);
+      // no report means the candidate was pruned, or the child died
+      if (Out.empty())
+        continue;
+      auto &R = Results[Base + k];
+      StringRef Rest(Out);
+      StringRef Flag, Insns;
+      std::tie(Flag, Rest) = Rest.split(' ');
+      std::tie(Insns, Rest) = Rest.split(' ');
+      R.Interesting = Flag == "1";
+      Insns.getAsInteger(10, R.Insns);
+      R.Choices = parseChoices(Rest.trim());
+    }
+  }
+  return Results;
+}
+
+std::vector<std::vector<int>> neighbours(const std::vector<int> &C) {
+  std::set<std::vector<int>> Seen{C};
+  std::vector<std::vector<int>> Res;
+  auto Add = [&](const std::vector<int> &N) {
+    if (Seen.insert(N).second)
+      Res.push_back(N);
+  };
+  for (unsigned i = 0; i < C.size(); ++i) {
+    // dropping the tail tends to remove whole instructions at once
+    Add(std::vector<int>(C.begin(), C.begin() + i));
+    if (C[i] > 0) {
+      auto N = C;
+      N[i] = 0;
+      Add(N);
+    }
+    if (C[i] > 1) {
+      auto N = C;
+      N[i]--;
+      Add(N);
+    }
+    // deleting a span can splice a subtree into its parent's place
+    for (unsigned Len = 1; Len <= 8 && i + Len <= C.size(); ++Len) {
+      auto N = C;
+      N.erase(N.begin() + i, N.begin() + i + Len);
+      Add(N);
+    }
+  }
+  return Res;
+}
+
+int reduce() {
+  if (Oracle.empty())
+    die("--reduce needs an --oracle");
+  if (instantiating())
+    die("--reduce doesn't work with constant instantiation");
+
+  auto Start = tryCandidates({parseChoices(Reduce)});
+  if (!Start[0].Interesting)
+    die("the function given to --reduce isn't interesting to the oracle");
+  Candidate Best = Start[0];
+  errs() << "reducing: " << Best.Insns << " instructions, "
+         << Best.Choices.size() << " choices\n";
+
+  while (true) {
+    auto Results = tryCandidates(neighbours(Best.Choices));
+    bool Better = false;
+    for (auto &R : Results) {
+      if (R.Interesting && R < Best) {
+        Best = R;
+        Better = true;
+      }
+    }
+    if (!Better)
+      break;
+    errs() << "reduced to " << Best.Insns << " instructions, "
+           << Best.Choices.size() << " choices\n";
+  }
+
+  // print the winner the same way --replay would
+  Replaying = true;
+  ReplayChoices = Best.Choices;
+  setChoices("");
+  generate();
+  chooseWidth();
+  output();
+  return 0;
+}
+
+int DonePipe[2];
+
+/*
+ * the root process waits for all of its descendents and reports
+ */
+void finish() {
+  char buf[1];
+  // waiting while holding a slot would starve the others
+  decrease_runners();
+  ::close(DonePipe[1]);
+  ::read(DonePipe[0], buf, 1);
+  for (int p = 0; p < PRIO_LEVELS; ++p) {
+    for (int i = 0; i < MAX_DEPTH; i++) {
+      if (Shmem->Waiting[p][i] != 0 && !Shmem->Stop)
+        errs() << "oops, there are waiting processes at " << i << "\n";
+    }
+  }
+  stopWorkers();
+  if (Shmem->TimedOut)
+    errs() << "stopped after the --time-limit of " << TimeLimit
+           << " seconds\n";
+  if (CoverageGuided)
+    errs() << Shmem->NumFeatures << " coverage features seen\n";
+  if (Opt2 && !Replaying)
+    errs() << Shmem->NumCompared << " functions compared: "
+           << Shmem->NumDiffInsns << " differ in size, " << Shmem->NumDiffFlags
+           << " in flags or attributes, " << Shmem->NumDiffBehavior
+           << " in behavior (" << Shmem->NumWrong << " miscompiled)\n";
+  if (TimeCompile && !Replaying) {
+    errs() << Shmem->NumTimed << " functions timed, " << Shmem->NumSlow
+           << " slow; microseconds per function:\n"
+           << "       p50        p99      p99.9        max    slow\n";
+    // slowest first
+    std::vector<std::pair<long, int>> Order;
+    for (int H = 0; H < MAX_TIMED && Shmem->Hist[H].Name[0]; ++H)
+      Order.push_back({-bucketStart(percentileBucket(H, 99.9)), H});
+    std::sort(Order.begin(), Order.end());
+    for (auto &O : Order) {
+      int H = O.second;
+      long P[3];
+      int i = 0;
+      for (double Pct : {50.0, 99.0, 99.9})
+        P[i++] = bucketStart(percentileBucket(H, Pct));
+      long Max = Shmem->Hist[H].Max;
+      errs() << format("%10s %10s %10s %10s %7ld  ", micros(P[0]).c_str(),
+                       micros(P[1]).c_str(), micros(P[2]).c_str(),
+                       micros(Max).c_str(), (long)Shmem->Hist[H].NumSlow)
+             << Shmem->Hist[H].Name << "\n";
+    }
+  }
+  if (useVerifier()) {
+    errs() << Shmem->NumCorrect << " functions verified correct, "
+           << Shmem->NumFailed << " failed, " << Shmem->NumErrors
+           << " errors";
+    if (!VerdictCache.empty())
+      errs() << ", " << Shmem->NumCached << " verdicts from the cache";
+    errs() << "\n";
+  }
+}
+
 } // namespace
 
 int main(int argc, char **argv) {
@@ -985,12 +4146,48 @@ int main(int argc, char **argv) {
 
   if (W < 2)
     die("Width must be >= 2");
+  if (skeletons()) {
+    if (W.getNumOccurrences())
+      die("--width and --widths are mutually exclusive");
+    if (!FewConsts && !SymbolicConsts)
+      die("--widths needs --fewconsts or --symbolic-consts");
+    for (int Width : Widths)
+      if (Width < 2)
+        die("Width must be >= 2");
+    // at 4 bits or more, every kind of value has its own width
+    W = std::max(4, *std::max_element(Widths.begin(), Widths.end()));
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    StringRef A(argv[i]);
+    StringRef Name = A.ltrim('-').split('=').first;
+    if (A.startswith("-") &&
+        (Name == "replay" || Name == "seed" || Name == "reduce" ||
+         Name == "oracle")) {
+      // with "--seed 5" the value is the next argument
+      if (!A.contains('='))
+        ++i;
+      continue;
+    }
+    if (A.find_first_of(" \t'\"") == StringRef::npos) {
+      CommandLine += " " + A.str();
+    } else {
+      std::string Q = A.str();
+      for (size_t p = 0; (p = Q.find('\'', p)) != std::string::npos; p += 4)
+        Q.replace(p, 1, "'\\''");
+      CommandLine += " '" + Q + "'";
+    }
+  }
+
+  setChoices("");
 
   Shmem =
       (struct shared *)::mmap(0, sizeof(struct shared), PROT_READ | PROT_WRITE,
                               MAP_SHARED | MAP_ANON, -1, 0);
-  if (Shmem == MAP_FAILED)
+  if (Shmem == MAP_FAILED) {
+    Shmem = nullptr;
     die("mmap failed");
+  }
   Shmem->NextId = 1;
   Shmem->Running = 1;
   if (pthread_mutexattr_init(&Shmem->LockAttr) != 0)
@@ -1005,15 +4202,79 @@ int main(int argc, char **argv) {
   if (pthread_condattr_setpshared(&Shmem->CondAttr, PTHREAD_PROCESS_SHARED) !=
       0)
     die("pthread_condattr_setpshared failed");
-  for (int i = 0; i < MAX_DEPTH; ++i) {
-    if (pthread_cond_init(&Shmem->Cond[i], &Shmem->CondAttr) != 0)
-      die("pthread_cond_init failed");
-    Shmem->Waiting[i] = 0;
+  for (int p = 0; p < PRIO_LEVELS; ++p) {
+    for (int i = 0; i < MAX_DEPTH; ++i) {
+      if (pthread_cond_init(&Shmem->Cond[p][i], &Shmem->CondAttr) != 0)
+        die("pthread_cond_init failed");
+      Shmem->Waiting[p][i] = 0;
+      Shmem->Signaled[p][i] = 0;
+    }
   }
+  if (pthread_cond_init(&Shmem->WorkerCond, &Shmem->CondAttr) != 0)
+    die("pthread_cond_init failed");
   Init = 1;
 
-  int p[2];
-  pid_t original_pid = ::getpid();
+  setupConsts();
+  setupShapes();
+  setupTargets();
+  setupConstraints();
+  if (!VerifierCmd.empty() && !VerifierSocket.empty())
+    die("--verifier and --verifier-socket are mutually exclusive");
+  if (!Passes.empty())
+    Opt = new Pipeline(Passes);
+  if (!ComparePasses.empty()) {
+    if (!Opt)
+      die("--compare-passes needs --passes");
+    if (useVerifier())
+      die("--compare-passes and --verifier are mutually exclusive");
+    Opt2 = new Pipeline(ComparePasses);
+  }
+  if (TimeCompile) {
+    if (!Opt && !TimeCodegen)
+      die("--time-compile needs --passes or --time-codegen");
+    if (Opt2 || useVerifier() || CoverageGuided)
+      die("--time-compile doesn't combine with --compare-passes, "
+          "--verifier, or --coverage-guided");
+    if (TimeCodegen)
+      setupCodegen();
+  } else if (TimeCodegen) {
+    die("--time-codegen needs --time-compile");
+  }
+  if (CoverageGuided) {
+    if (!Opt)
+      die("--coverage-guided needs --passes");
+    EnableStatistics(false);
+  }
+  if (!Reduce.empty())
+    return reduce();
+  if (!Replay.empty()) {
+    ReplayChoices = parseChoices(Replay);
+    Replaying = true;
+  }
+  if (useVerifier())
+    ::signal(SIGPIPE, SIG_IGN);
+  if (!VerdictCache.empty()) {
+    if (!useVerifier())
+      die("--verdict-cache needs --verifier or --verifier-socket");
+    if (sys::fs::create_directories(VerdictCache))
+      die("can't create verdict cache directory");
+  }
+  if (Opt2 && !Replaying) {
+    std::string Header = "function,insns_a,insns_b,flags_a,flags_b,attrs_a,"
+                         "attrs_b,behavior,input\n";
+    if (OutTargets.size() > 1)
+      for (auto &T : OutTargets)
+        writeFile(std::string(T.Name) + "/" + CompareCSV, Header);
+    else
+      writeFile(CompareCSV, Header);
+  }
+  // before the pipe below is created, so workers can't hold it open
+  if (!VerifierCmd.empty())
+    startWorkers();
+
+  RootPid = ::getpid();
+  if (TimeLimit)
+    Deadline = ::time(nullptr) + TimeLimit;
   if (::atexit(decrease_runners) != 0)
     die("atexit failed");
   /*
@@ -1023,21 +4284,19 @@ int main(int argc, char **argv) {
    * implicitly closing its fds when they terminate. at that point
    * reading from the pipe will not block but rather return with EOF
    */
-  if (::pipe(p) != 0)
+  if (::pipe(DonePipe) != 0)
     die("pipe failed??");
 
   generate();
+  chooseWidth();
   output();
+  if (Replaying && ReplayPos != ReplayChoices.size())
+    errs() << "warning: --replay choice string has unused choices\n";
 
-  if (::getpid() == original_pid) {
-    char buf[1];
-    ::close(p[1]);
-    ::read(p[0], buf, 1);
-    for (int i = 0; i < MAX_DEPTH; i++) {
-      if (Shmem->Waiting[i] != 0)
-        errs() << "oops, there are waiting processes at " << i << "\n";
-    }
-  }
+  if (::getpid() == RootPid)
+    finish();
+  else
+    exitDescendant();
 
   return 0;
 }
@@ -0,0 +1,37 @@
+#!/bin/sh
+# check opt-fuzz's own printer against LLVM's AsmWriter: every mode
+# below prints something the others don't, and --check-printer
+# aborts on the first function the two printers disagree on
+#
+# usage: check-printer.sh [path to opt-fuzz]
+
+OPTFUZZ=${1:-${OPTFUZZ:-build/opt-fuzz}}
+OPTFUZZ=$(cd "$(dirname "$OPTFUZZ")" && pwd)/$(basename "$OPTFUZZ")
+ARGS='--fast-printer --check-printer --verify --fewconsts --num-insns=1'
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+FAILED=0
+
+check() {
+    rm -rf "$OUT"/*
+    if (cd "$OUT" && "$OPTFUZZ" $ARGS "$@" > "$OUT/log" 2>&1) &&
+        ! grep -q ABORTING "$OUT/log"; then
+        echo "ok: $*"
+    else
+        echo "FAILED: $*"
+        tail -40 "$OUT/log"
+        FAILED=1
+    fi
+}
+
+check --width=4
+check --width=4 --branches --num-blocks=3
+check --width=4 --symbolic-consts
+check --width=4 --args-from-memory --return-to-memory
+check --width=4 --targets=x86_64,aarch64,riscv64,i686
+check --width=8 --promote=32
+check --widths=4,8,16
+check --width=4 --passes=instcombine
+check --width=4 --args-from-memory --opaque-pointers
+
+exit $FAILED
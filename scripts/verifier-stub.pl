@@ -0,0 +1,130 @@
+#!/usr/bin/perl -w
+
+# A stand-in for a real verifier that speaks the opt-fuzz worker
+# protocol, so that pipelines built around --verifier or
+# --verifier-socket can be tested without Alive installed.
+#
+# Every message is a 4-byte big-endian length followed by that many
+# bytes. A request is three messages (function name, original module,
+# optimized module -- possibly empty) and the reply is one message
+# whose first line is OK, FAIL, or ERROR, followed by a log.
+#
+# With no options this talks to a single opt-fuzz over stdin/stdout:
+#
+#   opt-fuzz --verifier="verifier-stub.pl --fail-regex=udiv"
+#
+# With --socket it listens on a Unix socket using a pool of
+# --workers pre-forked processes, one request per connection:
+#
+#   verifier-stub.pl --socket=/tmp/v.sock --workers=8 &
+#   opt-fuzz --verifier-socket=/tmp/v.sock
+#
+# A real worker would wrap alive-tv (or similar) in the same loop.
+
+use strict;
+use Getopt::Long;
+use IO::Handle;
+use IO::Socket::UNIX;
+use Socket;
+
+my $SOCKET;
+my $WORKERS = 4;
+my $FAIL_REGEX;
+my $FAIL_EVERY = 0;
+
+GetOptions("socket=s" => \$SOCKET,
+           "workers=i" => \$WORKERS,
+           "fail-regex=s" => \$FAIL_REGEX,
+           "fail-every=i" => \$FAIL_EVERY)
+    or die "usage: verifier-stub.pl [--socket=PATH] [--workers=N] ".
+    "[--fail-regex=RE] [--fail-every=N]\n";
+
+sub read_exactly($$) {
+    (my $fh, my $len) = @_;
+    my $buf = "";
+    while (length($buf) < $len) {
+        my $n = sysread($fh, $buf, $len - length($buf), length($buf));
+        die "read error: $!" unless defined $n;
+        return undef if $n == 0;
+    }
+    return $buf;
+}
+
+sub recv_msg($) {
+    (my $fh) = @_;
+    my $hdr = read_exactly($fh, 4);
+    return undef unless defined $hdr;
+    my $len = unpack("N", $hdr);
+    return "" if $len == 0;
+    my $msg = read_exactly($fh, $len);
+    die "truncated message" unless defined $msg;
+    return $msg;
+}
+
+sub send_msg($$) {
+    (my $fh, my $msg) = @_;
+    my $buf = pack("N", length($msg)) . $msg;
+    while (length($buf) > 0) {
+        my $n = syswrite($fh, $buf);
+        die "write error: $!" unless defined $n;
+        substr($buf, 0, $n) = "";
+    }
+}
+
+my $count = 0;
+
+sub verdict($$$) {
+    (my $name, my $src, my $tgt) = @_;
+    $count++;
+    my $log = "----------------------------------------\n${src}=>\n${tgt}\n";
+    return ("ERROR", $log."ERROR: no function definition in $name\n")
+        unless $src =~ /^define /m;
+    if ((defined $FAIL_REGEX && ($src.$tgt) =~ /$FAIL_REGEX/) ||
+        ($FAIL_EVERY > 0 && $count % $FAIL_EVERY == 0)) {
+        return ("FAIL", $log."Transformation doesn't verify!\n".
+                "ERROR: flagged by verifier-stub\n");
+    }
+    return ("OK", $log."Transformation seems to be correct!\n");
+}
+
+sub serve($$) {
+    (my $in, my $out) = @_;
+    while (defined(my $name = recv_msg($in))) {
+        my $src = recv_msg($in);
+        my $tgt = recv_msg($in);
+        die "truncated request" unless defined $src && defined $tgt;
+        (my $v, my $log) = verdict($name, $src, $tgt);
+        send_msg($out, "$v\n$log");
+    }
+}
+
+if (!defined $SOCKET) {
+    binmode STDIN;
+    binmode STDOUT;
+    serve(\*STDIN, \*STDOUT);
+    exit 0;
+}
+
+unlink $SOCKET;
+my $listener = IO::Socket::UNIX->new(Type => SOCK_STREAM,
+                                     Local => $SOCKET,
+                                     Listen => SOMAXCONN)
+    or die "can't listen on $SOCKET: $!";
+
+my @kids;
+for (my $i = 0; $i < $WORKERS; $i++) {
+    my $pid = fork();
+    die "fork failed" unless defined $pid;
+    if ($pid == 0) {
+        while (my $conn = $listener->accept()) {
+            binmode $conn;
+            serve($conn, $conn);
+            close $conn;
+        }
+        exit 0;
+    }
+    push @kids, $pid;
+}
+
+$SIG{INT} = $SIG{TERM} = sub { kill 'TERM', @kids; unlink $SOCKET; exit 0; };
+waitpid($_, 0) foreach @kids;
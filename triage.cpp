@@ -0,0 +1,372 @@
+//===---- triage.cpp - Bucket verifier failures on opt-fuzz output ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This utility scans the logs left behind by verifying opt-fuzz output
+// (check-file.pl's output/*.log, or the NAME.log files written by
+// opt-fuzz --verifier) and sorts the failures into buckets, so that
+// each distinct problem shows up once, with a count and some examples.
+//
+// A failure's signature is the verifier's complaint (with names and
+// numbers abstracted away) plus what the optimizer did: which
+// instructions, counting their flags and predicates, disappeared from
+// the source function and which ones showed up in the target.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+llvm::cl::OptionCategory triage_args("Options for opt-fuzz-triage");
+
+cl::list<std::string> Inputs(cl::Positional,
+                             cl::desc("<log files or directories of logs>"),
+                             cl::OneOrMore, llvm::cl::cat(triage_args));
+
+cl::opt<int> Jobs("jobs",
+                  cl::desc("How many threads to use (default=all cores)"),
+                  cl::init(0), llvm::cl::cat(triage_args));
+
+cl::opt<int> Examples("examples",
+                      cl::desc("Log files to list per bucket (default=3)"),
+                      cl::init(3), llvm::cl::cat(triage_args));
+
+cl::opt<bool>
+    BySource("by-source",
+             cl::desc("Also bucket on the instructions in the source "
+                      "function, not just on what changed (default=false)"),
+             cl::init(false), llvm::cl::cat(triage_args));
+
+cl::opt<std::string> Suffix("suffix",
+                            cl::desc("Suffix of log files to pick up in "
+                                     "directories (default=\".log\")"),
+                            cl::init(".log"), llvm::cl::cat(triage_args));
+
+struct Bucket {
+  long Count = 0;
+  std::vector<std::string> Files;
+};
+
+struct Result {
+  std::unordered_map<std::string, Bucket> Buckets;
+  long Correct = 0, Failed = 0, Errors = 0, NoVerdict = 0;
+};
+
+// replace names and numbers so that messages about different
+// functions look the same
+std::string abstractMessage(StringRef S) {
+  std::string Out;
+  for (size_t i = 0; i < S.size();) {
+    if (S[i] == '%' || S[i] == '@') {
+      Out += S[i] == '%' ? "%_" : "@_";
+      ++i;
+      while (i < S.size() && (isAlnum(S[i]) || S[i] == '_' || S[i] == '.'))
+        ++i;
+    } else if (isDigit(S[i])) {
+      Out += 'N';
+      while (i < S.size() && isDigit(S[i]))
+        ++i;
+    } else {
+      Out += S[i++];
+    }
+  }
+  return Out;
+}
+
+bool isFlag(StringRef T) {
+  return T == "nsw" || T == "nuw" || T == "exact" || T == "disjoint" ||
+         T == "nneg";
+}
+
+// drop type suffixes from intrinsic names: llvm.ctlz.i8 -> llvm.ctlz
+std::string intrinsicName(StringRef Name) {
+  SmallVector<StringRef, 4> Parts;
+  Name.split(Parts, '.');
+  std::string Out;
+  for (auto P : Parts) {
+    if (P.size() > 1 && (P[0] == 'i' || P[0] == 'v') &&
+        all_of(P.drop_front(), [](char c) { return isAlnum(c); }) &&
+        any_of(P.drop_front(), [](char c) { return isDigit(c); }))
+      continue;
+    if (!Out.empty())
+      Out += '.';
+    Out += P.str();
+  }
+  return Out;
+}
+
+// one token per instruction: opcode, flags, and predicate or callee
+void summarize(StringRef Func, std::vector<std::string> &Ops) {
+  SmallVector<StringRef, 32> Lines;
+  Func.split(Lines, '\n');
+  for (auto L : Lines) {
+    L = L.trim();
+    if (L.empty() || L.startswith("define") || L.startswith("declare") ||
+        L.startswith("}") || L.endswith(":") || L.startswith(";"))
+      continue;
+    size_t Eq = L.find(" = ");
+    if (Eq != StringRef::npos)
+      L = L.substr(Eq + 3);
+    SmallVector<StringRef, 8> Toks;
+    L.split(Toks, ' ', -1, /*KeepEmpty=*/false);
+    unsigned i = 0;
+    while (i < Toks.size() &&
+           (Toks[i] == "tail" || Toks[i] == "musttail" || Toks[i] == "notail"))
+      ++i;
+    if (i == Toks.size())
+      continue;
+    std::string Op = Toks[i++].lower();
+    if (Op == "icmp" || Op == "fcmp") {
+      if (i < Toks.size())
+        Op += "." + Toks[i].str();
+    } else if (Op == "call") {
+      size_t At = L.find('@');
+      if (At != StringRef::npos) {
+        StringRef Callee = L.substr(At + 1);
+        Callee = Callee.substr(0, Callee.find('('));
+        Op = intrinsicName(Callee);
+      }
+    } else {
+      for (; i < Toks.size() && isFlag(Toks[i]); ++i)
+        Op += " " + Toks[i].str();
+    }
+    Ops.push_back(Op);
+  }
+  std::sort(Ops.begin(), Ops.end());
+}
+
+std::string joinOps(const std::vector<std::string> &Ops, StringRef Prefix) {
+  std::string Out;
+  for (auto &O : Ops) {
+    if (!Out.empty())
+      Out += ' ';
+    Out += Prefix.str() + "[" + O + "]";
+  }
+  return Out;
+}
+
+/*
+ * Alive logs look like
+ *
+ *   ----------------------------------------
+ *   define ... source ...
+ *   =>
+ *   define ... target ...
+ *   Transformation doesn't verify!
+ *   ERROR: Value mismatch
+ *
+ * and the logs opt-fuzz writes start with a line saying OK, FAIL, or
+ * ERROR followed by whatever the worker said. if there are several
+ * transformations in a log we look at the last one that failed
+ */
+void triage(StringRef Log, const std::string &FN, Result &R) {
+  StringRef Verdict, Src, Tgt;
+  bool Correct = false;
+  const StringRef Dashes = "----------------------------------------";
+  size_t Pos = 0;
+  while (true) {
+    size_t Sep = Log.find(Dashes, Pos);
+    if (Sep == StringRef::npos)
+      break;
+    Pos = Sep + Dashes.size();
+    if (Sep != 0 && Log[Sep - 1] != '\n')
+      continue;
+    StringRef Block = Log.substr(Sep).split('\n').second;
+    Block = Block.substr(0, Block.find("\n" + Dashes.str()));
+
+    size_t Arrow = Block.find("\n=>\n");
+    size_t End = Block.find("\nTransformation ");
+    size_t Err = Block.find("\nERROR: ");
+    if (Err != StringRef::npos && (End == StringRef::npos || Err < End))
+      End = Err;
+    if (Block.find("Transformation seems to be correct") != StringRef::npos &&
+        Err == StringRef::npos) {
+      Correct = true;
+      continue;
+    }
+    if (Err == StringRef::npos)
+      continue;
+    StringRef Msg = Block.substr(Err + 8);
+    Verdict = Msg.substr(0, Msg.find('\n')).trim();
+    if (Arrow != StringRef::npos && Arrow < End) {
+      Src = Block.substr(0, Arrow);
+      Tgt = Block.substr(Arrow + 4, End - Arrow - 4);
+    } else {
+      Src = Block.substr(0, End);
+      Tgt = "";
+    }
+  }
+
+  if (Verdict.empty()) {
+    // no transformation blocks; maybe the verifier itself failed
+    size_t Err = Log.find("ERROR: ");
+    if (Err != StringRef::npos) {
+      StringRef Msg = Log.substr(Err + 7);
+      Verdict = Msg.substr(0, Msg.find('\n')).trim();
+    } else if (Correct || Log.startswith("OK\n")) {
+      R.Correct++;
+      return;
+    } else {
+      R.NoVerdict++;
+      Verdict = "no verdict";
+    }
+  }
+
+  bool Incorrect = Log.find("Transformation doesn't verify") !=
+                       StringRef::npos ||
+                   Log.startswith("FAIL\n");
+  if (Incorrect)
+    R.Failed++;
+  else if (Verdict != "no verdict")
+    R.Errors++;
+
+  std::vector<std::string> SrcOps, TgtOps, Gone, New;
+  summarize(Src, SrcOps);
+  summarize(Tgt, TgtOps);
+  std::set_difference(SrcOps.begin(), SrcOps.end(), TgtOps.begin(),
+                      TgtOps.end(), std::back_inserter(Gone));
+  std::set_difference(TgtOps.begin(), TgtOps.end(), SrcOps.begin(),
+                      SrcOps.end(), std::back_inserter(New));
+
+  std::string Key = std::string(Incorrect ? "incorrect: " : "error: ") +
+                    abstractMessage(Verdict) + " |";
+  if (BySource)
+    Key += " src " + joinOps(SrcOps, "") + " |";
+  if (Gone.empty() && New.empty())
+    Key += Tgt.empty() ? " no target" : " no change";
+  else
+    Key += " " + joinOps(Gone, "-") + (Gone.empty() || New.empty() ? "" : " ") +
+           joinOps(New, "+");
+
+  auto &B = R.Buckets[Key];
+  B.Count++;
+  if ((int)B.Files.size() < Examples)
+    B.Files.push_back(FN);
+}
+
+void triageFile(const std::string &FN, Result &R) {
+  int fd = open(FN.c_str(), O_RDONLY);
+  if (fd < 0) {
+    errs() << "can't open " << FN << "\n";
+    return;
+  }
+  struct stat St;
+  if (fstat(fd, &St) != 0 || St.st_size == 0) {
+    close(fd);
+    triage(StringRef(), FN, R);
+    return;
+  }
+  void *P = mmap(0, St.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (P == MAP_FAILED) {
+    errs() << "can't map " << FN << "\n";
+    return;
+  }
+  triage(StringRef((const char *)P, St.st_size), FN, R);
+  munmap(P, St.st_size);
+}
+
+void collect(const std::string &Path, std::vector<std::string> &Files) {
+  if (!sys::fs::is_directory(Path)) {
+    Files.push_back(Path);
+    return;
+  }
+  std::error_code EC;
+  for (sys::fs::directory_iterator I(Path, EC), E; I != E && !EC;
+       I.increment(EC))
+    if (StringRef(I->path()).endswith(Suffix))
+      Files.push_back(I->path());
+  if (EC)
+    errs() << "error reading " << Path << ": " << EC.message() << "\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  PrettyStackTraceProgram X(argc, argv);
+  cl::HideUnrelatedOptions(triage_args);
+  cl::ParseCommandLineOptions(argc, argv, "opt-fuzz failure triage\n");
+
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<std::string> Files;
+  for (auto &In : Inputs)
+    collect(In, Files);
+
+  unsigned NumThreads = Jobs > 0 ? Jobs : std::thread::hardware_concurrency();
+  if (NumThreads == 0)
+    NumThreads = 1;
+  std::vector<Result> Results(NumThreads);
+  std::atomic<size_t> Next(0);
+  std::vector<std::thread> Threads;
+  for (unsigned t = 0; t < NumThreads; ++t) {
+    Threads.emplace_back([&, t] {
+      for (size_t i = Next.fetch_add(1); i < Files.size();
+           i = Next.fetch_add(1))
+        triageFile(Files[i], Results[t]);
+    });
+  }
+  for (auto &T : Threads)
+    T.join();
+
+  Result All;
+  for (auto &R : Results) {
+    All.Correct += R.Correct;
+    All.Failed += R.Failed;
+    All.Errors += R.Errors;
+    All.NoVerdict += R.NoVerdict;
+    for (auto &It : R.Buckets) {
+      auto &B = All.Buckets[It.first];
+      B.Count += It.second.Count;
+      for (auto &F : It.second.Files)
+        if ((int)B.Files.size() < Examples)
+          B.Files.push_back(F);
+    }
+  }
+
+  std::vector<std::pair<std::string, Bucket>> Sorted(All.Buckets.begin(),
+                                                     All.Buckets.end());
+  std::sort(Sorted.begin(), Sorted.end(), [](auto &A, auto &B) {
+    return A.second.Count != B.second.Count ? A.second.Count > B.second.Count
+                                            : A.first < B.first;
+  });
+  for (auto &It : Sorted) {
+    outs() << format_decimal(It.second.Count, 9) << "  " << It.first << "\n";
+    for (auto &F : It.second.Files)
+      outs() << "           " << F << "\n";
+  }
+
+  double Secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start)
+                    .count();
+  errs() << Files.size() << " logs in " << format("%.2f", Secs) << "s: "
+         << All.Correct << " correct, " << All.Failed << " incorrect, "
+         << All.Errors << " errors, " << All.NoVerdict << " without a verdict, "
+         << Sorted.size() << " buckets\n";
+  return 0;
+}